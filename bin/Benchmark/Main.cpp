@@ -0,0 +1,236 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/Expr.h>
+#include <clang/AST/Stmt.h>
+#include <clang/Basic/LangOptions.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/Triple.h>
+#pragma GCC diagnostic pop
+
+#include "../../lib/Clang.h"
+#include "../../lib/ClangFactory.h"
+
+using namespace std;
+
+using UnitCreator = unique_ptr<pillar::ClangUnit> (*)(const llvm::Triple &);
+
+static void Usage(const char *self)
+{
+  cerr << "Usage: " << self
+       << " [--iterations <n>] [--nodes <n>] [--triple <triple>]\n"
+       << "\n"
+       << "Measures the cost of creating the empty Clang translation unit into\n"
+       << "which a VAST module is lifted, for each of the ways of building it,\n"
+       << "and the per-node cost of building expressions and statements, for\n"
+       << "each builder mode.\n";
+}
+
+// Time `iterations` unit creations. The first creation is reported on its own
+// as the cold cost, because it pays for per-process and per-triple setup that
+// later creations reuse.
+static bool Measure(string_view name, UnitCreator create,
+                    const llvm::Triple &triple, unsigned iterations)
+{
+  using Clock = chrono::steady_clock;
+  using Micros = chrono::duration<double, micro>;
+
+  auto start = Clock::now();
+  if (!create(triple))
+  {
+    cerr << name << ": could not create a translation unit for "
+         << triple.str() << "\n";
+    return false;
+  }
+  const Micros cold = Clock::now() - start;
+
+  start = Clock::now();
+  for (unsigned i = 1u; i < iterations; ++i)
+  {
+    if (!create(triple))
+    {
+      cerr << name << ": could not create a translation unit for "
+           << triple.str() << "\n";
+      return false;
+    }
+  }
+  const Micros warm = Clock::now() - start;
+
+  cout << name << ": cold " << cold.count() << "us";
+  if (iterations > 1u)
+  {
+    cout << ", warm " << (warm.count() / (iterations - 1u)) << "us/unit";
+  }
+  cout << "\n";
+  return true;
+}
+
+static const char *ModeName(pillar::BuilderMode mode)
+{
+  switch (mode)
+  {
+  case pillar::BuilderMode::kSema:
+    return "sema";
+  case pillar::BuilderMode::kTrusted:
+    return "trusted";
+  case pillar::BuilderMode::kVerify:
+    return "verify";
+  }
+  return "unknown";
+}
+
+// Time building `num_nodes` nodes the way that lifting `if (!((a + b) < b))`
+// does: two reads, an addition, a comparison, a negation, and an `if`.
+static bool MeasureNodes(pillar::BuilderMode mode, const llvm::Triple &triple,
+                         unsigned num_nodes)
+{
+  using Clock = chrono::steady_clock;
+  using Nanos = chrono::duration<double, nano>;
+
+  pillar::LiftOptions options;
+  options.lean_frontend = true;
+  options.builder_mode = mode;
+  std::unique_ptr<pillar::ClangUnit> unit =
+      pillar::ClangModuleImpl::CreateUnit(triple, options);
+  if (!unit)
+  {
+    cerr << ModeName(mode) << ": could not create a translation unit for "
+         << triple.str() << "\n";
+    return false;
+  }
+  pillar::ClangModuleImpl impl(std::move(unit), options);
+
+  clang::ASTContext &ctx = impl.ctx;
+  clang::TranslationUnitDecl *tu = ctx.getTranslationUnitDecl();
+  clang::VarDecl *a = impl.CreateVarDeclFromStrRef(tu, tu, ctx.IntTy, "a");
+  clang::VarDecl *b = impl.CreateVarDeclFromStrRef(tu, tu, ctx.IntTy, "b");
+  tu->addDecl(a);
+  tu->addDecl(b);
+
+  // VAST makes lvalue-to-rvalue conversions explicit, so do the same.
+  auto read = [&](clang::VarDecl *var) -> clang::Expr *
+  {
+    return clang::ImplicitCastExpr::Create(
+        ctx, var->getType(), clang::CK_LValueToRValue, impl.CreateDeclRef(var),
+        /*BasePath=*/nullptr, clang::VK_PRValue, clang::FPOptionsOverride());
+  };
+
+  constexpr unsigned kNodesPerIteration = 4u;
+  const unsigned iterations = max(1u, num_nodes / kNodesPerIteration);
+
+  // Reads aren't what is being measured, so build them up front.
+  std::vector<clang::Expr *> reads;
+  reads.reserve(iterations * 2u);
+  for (unsigned i = 0u; i < iterations; ++i)
+  {
+    reads.push_back(read(a));
+    reads.push_back(read(b));
+  }
+  clang::CompoundStmt *then_stmt = impl.CreateCompoundStmt({});
+
+  const auto start = Clock::now();
+  for (unsigned i = 0u; i < iterations; ++i)
+  {
+    clang::Expr *sum = impl.CreateAdd(reads[i * 2u], reads[i * 2u + 1u],
+                                      ctx.IntTy);
+    clang::Expr *cmp = impl.CreateLT(sum, reads[i * 2u + 1u], ctx.IntTy);
+    clang::Expr *neg = impl.CreateLNot(cmp, ctx.IntTy);
+    if (!impl.CreateIf(neg, then_stmt, /*has_else=*/false))
+    {
+      cerr << ModeName(mode) << ": could not build an `if` statement\n";
+      return false;
+    }
+  }
+  const Nanos elapsed = Clock::now() - start;
+
+  cout << ModeName(mode) << ": "
+       << (elapsed.count() / (iterations * kNodesPerIteration)) << "ns/node\n";
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned iterations = 100u;
+  unsigned num_nodes = 1000000u;
+  string triple_str = llvm::sys::getDefaultTargetTriple();
+
+  for (int i = 1; i < argc; ++i)
+  {
+    string_view arg = argv[i];
+    if ((arg == "--iterations" || arg == "--nodes" || arg == "--triple") &&
+        i + 1 < argc)
+    {
+      if (arg == "--iterations")
+      {
+        iterations = static_cast<unsigned>(atoi(argv[++i]));
+      }
+      else if (arg == "--nodes")
+      {
+        num_nodes = static_cast<unsigned>(atoi(argv[++i]));
+      }
+      else
+      {
+        triple_str = argv[++i];
+      }
+    }
+    else if (arg == "-h" || arg == "--help")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else
+    {
+      cerr << "Unexpected argument: " << arg << "\n";
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!iterations || !num_nodes)
+  {
+    cerr << "Number of iterations and nodes must be positive\n";
+    return EXIT_FAILURE;
+  }
+
+  const llvm::Triple triple(triple_str);
+  cout << "Creating " << iterations << " translation units for "
+       << triple.str() << "\n";
+
+  // The lean path goes first so that its cold time doesn't benefit from any
+  // process-wide state warmed up by the frontend.
+  bool ok = Measure("lean", &pillar::ClangUnitFactory::CreateLean, triple,
+                    iterations);
+  ok = Measure("tooling", &pillar::ClangUnitFactory::CreateWithTooling, triple,
+               iterations) && ok;
+  ok = Measure("cached invocation", &pillar::ClangUnitFactory::Create, triple,
+               iterations) && ok;
+
+  cout << "Building " << num_nodes << " expression and statement nodes\n";
+  for (pillar::BuilderMode mode :
+       {pillar::BuilderMode::kSema, pillar::BuilderMode::kTrusted,
+        pillar::BuilderMode::kVerify})
+  {
+    ok = MeasureNodes(mode, triple, num_nodes) && ok;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,369 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "Batch.h"
+#include "../../include/pillar/Clang.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <glob.h>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace pillar
+{
+  namespace
+  {
+
+    struct Job
+    {
+      fs::path input;
+      fs::path output;
+      uintmax_t size{0u};
+    };
+
+    struct Failure
+    {
+      fs::path input;
+      std::string reason;
+    };
+
+    // The extension of the output file written for each module.
+    static const char *OutputExtension(OutputMode mode)
+    {
+      switch (mode)
+      {
+      case OutputMode::kASTDump:
+        return ".ast.txt";
+      case OutputMode::kJSONAST:
+        return ".ast.json";
+      case OutputMode::kSerializedAST:
+        return ".ast";
+      case OutputMode::kNone:
+      case OutputMode::kCSource:
+        break;
+      }
+      return ".c";
+    }
+
+    static bool IsPattern(const std::string &spec)
+    {
+      return spec.find_first_of("*?[") != std::string::npos;
+    }
+
+    // Modules in a directory are either textual (`.mlir`) or bytecode
+    // (`.mlirbc`). Bytecode sidecars written by `--bytecode-cache` are named
+    // `<module>.mlir.mlirbc`, and are skipped in favor of their source module.
+    static bool IsModulePath(const fs::path &path)
+    {
+      const fs::path ext = path.extension();
+      if (ext == ".mlir")
+      {
+        return true;
+      }
+      return ext == ".mlirbc" && path.stem().extension() != ".mlir";
+    }
+
+    // Expand `spec` into a list of `(input path, path relative to output dir)`
+    // pairs.
+    static std::optional<std::vector<std::pair<fs::path, fs::path>>>
+    CollectInputs(const std::string &spec)
+    {
+      std::vector<std::pair<fs::path, fs::path>> inputs;
+      std::error_code ec;
+
+      if (spec.size() > 1 && spec.front() == '@')
+      {
+        // Manifest file; one path per line. Blank lines and `#` comments are
+        // ignored.
+        std::ifstream manifest(spec.substr(1));
+        if (!manifest)
+        {
+          std::cerr << "Could not open manifest " << spec.substr(1) << "\n";
+          return std::nullopt;
+        }
+        for (std::string line; std::getline(manifest, line);)
+        {
+          line.erase(0, line.find_first_not_of(" \t"));
+          line.erase(line.find_last_not_of(" \t\r") + 1);
+          if (!line.empty() && line.front() != '#')
+          {
+            fs::path path(line);
+            inputs.emplace_back(path, path.filename());
+          }
+        }
+      }
+      else if (fs::is_directory(spec, ec))
+      {
+        // Directory; mirror its layout into the output directory.
+        fs::path root(spec);
+        for (const fs::directory_entry &entry :
+             fs::recursive_directory_iterator(root, ec))
+        {
+          if (entry.is_regular_file() && IsModulePath(entry.path()))
+          {
+            inputs.emplace_back(entry.path(),
+                                entry.path().lexically_relative(root));
+          }
+        }
+        if (ec)
+        {
+          std::cerr << "Could not walk directory " << spec << ": "
+                    << ec.message() << "\n";
+          return std::nullopt;
+        }
+      }
+      else if (IsPattern(spec))
+      {
+        // Glob pattern.
+        glob_t matches = {};
+        if (int ret = glob(spec.c_str(), 0, nullptr, &matches);
+            ret != 0 && ret != GLOB_NOMATCH)
+        {
+          std::cerr << "Could not expand pattern " << spec << "\n";
+          globfree(&matches);
+          return std::nullopt;
+        }
+        for (size_t i = 0u; i < matches.gl_pathc; ++i)
+        {
+          fs::path path(matches.gl_pathv[i]);
+          if (fs::is_regular_file(path, ec))
+          {
+            inputs.emplace_back(path, path.filename());
+          }
+        }
+        globfree(&matches);
+      }
+      else
+      {
+        // Single file.
+        fs::path path(spec);
+        inputs.emplace_back(path, path.filename());
+      }
+
+      return inputs;
+    }
+
+    // Per-worker queue of jobs. The owner takes the largest remaining job from
+    // the front, and thieves take the smallest from the back, so that big
+    // modules start early and stealing rarely contends with the owner.
+    class WorkQueue
+    {
+    private:
+      std::mutex lock;
+      std::deque<Job> jobs;
+
+    public:
+      void Push(Job job)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        jobs.emplace_back(std::move(job));
+      }
+
+      std::optional<Job> Pop(void)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        if (jobs.empty())
+        {
+          return std::nullopt;
+        }
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        return job;
+      }
+
+      std::optional<Job> Steal(void)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        if (jobs.empty())
+        {
+          return std::nullopt;
+        }
+        Job job = std::move(jobs.back());
+        jobs.pop_back();
+        return job;
+      }
+    };
+
+    // Decompile a single module. Returns an error message on failure.
+    static std::optional<std::string> Decompile(const Job &job,
+                                                const BatchOptions &options)
+    {
+      auto maybe_module = VASTModule::DeserializeFile(
+          job.input.string(), options.deserialize_options);
+      if (!maybe_module)
+      {
+        return "Invalid VAST IR module";
+      }
+
+      std::error_code ec;
+      fs::create_directories(job.output.parent_path(), ec);
+
+      if (options.stream)
+      {
+        if (!ClangModule::LiftAndEmit(maybe_module.value(), job.output.string(),
+                                      options.lift_options,
+                                      options.emit_options))
+        {
+          return "Could not lift VAST IR module into " + job.output.string();
+        }
+        return std::nullopt;
+      }
+
+      auto maybe_ast = ClangModule::Lift(maybe_module.value(),
+                                         options.lift_options);
+      if (!maybe_ast)
+      {
+        return "Could not lift VAST IR module into an AST";
+      }
+
+      if (!maybe_ast->Emit(job.output.string(), options.emit_options))
+      {
+        return "Could not write output file " + job.output.string();
+      }
+
+      return std::nullopt;
+    }
+
+  } // namespace
+
+  int RunBatch(const BatchOptions &options)
+  {
+    auto maybe_inputs = CollectInputs(options.inputs);
+    if (!maybe_inputs)
+    {
+      return EXIT_FAILURE;
+    }
+
+    // Build the jobs, disambiguating outputs that would otherwise collide
+    // (e.g. two manifest entries with the same file name).
+    std::vector<Job> jobs;
+    std::set<fs::path> used_outputs;
+    const fs::path output_dir(options.output_dir);
+    const std::string extension = OutputExtension(options.emit_options.mode);
+    for (auto &[input, relative] : maybe_inputs.value())
+    {
+      Job job;
+      job.input = std::move(input);
+      job.output = output_dir / relative;
+      job.output += extension;
+      for (unsigned i = 1u; !used_outputs.insert(job.output).second; ++i)
+      {
+        job.output = output_dir / relative;
+        job.output += "." + std::to_string(i) + extension;
+      }
+
+      std::error_code ec;
+      job.size = fs::file_size(job.input, ec);
+      if (ec)
+      {
+        job.size = 0u;
+      }
+      jobs.emplace_back(std::move(job));
+    }
+
+    if (jobs.empty())
+    {
+      std::cerr << "No VAST IR modules found in " << options.inputs << "\n";
+      return EXIT_FAILURE;
+    }
+
+    const unsigned num_workers = std::max(
+        1u, std::min<unsigned>(
+                options.num_workers ? options.num_workers
+                                    : std::thread::hardware_concurrency(),
+                static_cast<unsigned>(jobs.size())));
+
+    // Deal the jobs out largest-first, round robin, so that every worker starts
+    // with a similar amount of work in bytes.
+    std::stable_sort(jobs.begin(), jobs.end(),
+                     [](const Job &a, const Job &b)
+                     { return a.size > b.size; });
+
+    uintmax_t total_bytes = 0u;
+    std::vector<WorkQueue> queues(num_workers);
+    for (size_t i = 0u; i < jobs.size(); ++i)
+    {
+      total_bytes += jobs[i].size;
+      queues[i % num_workers].Push(std::move(jobs[i]));
+    }
+
+    std::mutex failures_lock;
+    std::vector<Failure> failures;
+    std::atomic<size_t> num_done{0u};
+
+    auto worker = [&](unsigned id)
+    {
+      for (;;)
+      {
+        std::optional<Job> job = queues[id].Pop();
+        for (unsigned i = 1u; !job && i < num_workers; ++i)
+        {
+          job = queues[(id + i) % num_workers].Steal();
+        }
+        if (!job)
+        {
+          return;
+        }
+
+        if (auto error = Decompile(job.value(), options))
+        {
+          std::lock_guard<std::mutex> locker(failures_lock);
+          failures.push_back({job->input, std::move(error.value())});
+        }
+        num_done.fetch_add(1u);
+      }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    threads.reserve(num_workers);
+    for (unsigned i = 0u; i < num_workers; ++i)
+    {
+      threads.emplace_back(worker, i);
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    const size_t num_modules = num_done.load();
+    const double seconds = std::max(elapsed.count(), 1e-9);
+    const double mebibytes = static_cast<double>(total_bytes) / (1024.0 * 1024.0);
+
+    std::sort(failures.begin(), failures.end(),
+              [](const Failure &a, const Failure &b)
+              { return a.input < b.input; });
+    for (const Failure &failure : failures)
+    {
+      std::cerr << "FAILED " << failure.input.string() << ": "
+                << failure.reason << "\n";
+    }
+
+    std::cerr << "Decompiled " << (num_modules - failures.size()) << "/"
+              << num_modules << " modules (" << failures.size()
+              << " failed) with " << num_workers << " workers in " << seconds
+              << "s; " << (static_cast<double>(num_modules) / seconds)
+              << " modules/s, " << (mebibytes / seconds) << " MiB/s\n";
+
+    return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+} // namespace pillar
@@ -0,0 +1,45 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include "../../include/pillar/Clang.h"
+#include "../../include/pillar/VAST.h"
+
+#include <string>
+
+namespace pillar
+{
+
+  struct BatchOptions
+  {
+    // A directory (searched recursively for `.mlir` and `.mlirbc` files), a
+    // glob pattern, or `@<path>` naming a manifest file with one module path
+    // per line.
+    std::string inputs;
+
+    // Directory into which each module's output is written. The output file is
+    // named after the module, with an extension that depends on
+    // `emit_options.mode`.
+    std::string output_dir;
+
+    // Number of worker threads. Zero means one per hardware thread.
+    unsigned num_workers{0u};
+
+    // Write each function as soon as it's lifted, as with
+    // `ClangModule::LiftAndEmit`, to bound the memory used by each worker.
+    bool stream{false};
+
+    DeserializeOptions deserialize_options;
+    LiftOptions lift_options;
+    EmitOptions emit_options;
+  };
+
+  // Decompile every module named by `options.inputs`, and print a summary of
+  // throughput and failures to `stderr`. Returns a process exit code.
+  int RunBatch(const BatchOptions &options);
+
+} // namespace pillar
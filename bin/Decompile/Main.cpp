@@ -4,35 +4,385 @@
 // This source code is licensed in accordance with the terms specified in
 // the LICENSE file found in the root directory of this source tree.
 
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#include <fstream>
 #include <iostream>
 // #include <pillar/VAST.h>
 // #include <pillar/Clang.h>
 #include "../../include/pillar/VAST.h"
 #include "../../include/pillar/Clang.h"
+#include "Batch.h"
+#include "Server.h"
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <optional>
+#include <vector>
 
 using namespace std;
 
+static void Usage(const char *self)
+{
+  cerr << "Usage: " << self
+       << " [options] [-o <path>] <path to VAST IR module | ->\n"
+       << "       " << self
+       << " [options] --batch <dir | glob | @manifest> --output-dir <dir>\n"
+       << "       " << self << " [options] --serve <socket path | ->\n"
+       << "\n"
+       << "Options:\n"
+       << "  -o <path>           Where to write the output (default: stdout)\n"
+       << "  --emit <mode>       What to write: `c` for C source (default),\n"
+       << "                      `ast` for Clang's AST dump, `json` for Clang's\n"
+       << "                      JSON AST dump, `pch` for a serialized Clang AST\n"
+       << "                      (`.ast`/`.pch`), or `none`\n"
+       << "  --print-threads <n> Number of threads printing C source (default:\n"
+       << "                      1; 0 means one per hardware thread)\n"
+       << "  --lift-threads <n>  Number of threads lifting function bodies\n"
+       << "                      (default: 1; 0 means one per hardware thread);\n"
+       << "                      only applies to C output\n"
+       << "  --max-expr-depth <n>\n"
+       << "                      Move values nested deeper than this into\n"
+       << "                      temporaries (default: 256; 0 means no limit)\n"
+       << "  --stream            Write each function as soon as it's lifted,\n"
+       << "                      after all declarations, to bound memory use\n"
+       << "  --index             Also write an index of where each function,\n"
+       << "                      global, and record is in C output files, to\n"
+       << "                      `<path>.idx`\n"
+       << "  --function <name>   Only lift the named function, and the globals\n"
+       << "                      that it uses; may be repeated\n"
+       << "  --function-cache <dir>\n"
+       << "                      Reuse the C code of functions that are\n"
+       << "                      unchanged since they were cached in <dir>;\n"
+       << "                      only applies to C output\n"
+       << "  --batch <inputs>    Decompile every module in a directory, matching\n"
+       << "                      a glob pattern, or listed in a manifest file\n"
+       << "  --output-dir <dir>  Where batch mode writes one file per module\n"
+       << "  --jobs <n>          Number of batch worker threads, or of connections\n"
+       << "                      served at once (default: one per hardware\n"
+       << "                      thread)\n"
+       << "  --serve <socket>    Keep running and answer length-prefixed module\n"
+       << "                      requests on a Unix socket, or on stdin/stdout\n"
+       << "                      when the socket is `-`\n"
+       << "  --max-request-mib <n>\n"
+       << "                      Largest request the server accepts, in MiB\n"
+       << "                      (default: 1024)\n"
+       << "  --bytecode-cache    Reuse (or create) a `.mlirbc` bytecode sidecar\n"
+       << "                      next to textual input modules\n"
+       << "  --lazy-bodies       Defer reading function bodies from bytecode\n"
+       << "                      input until they are lifted\n"
+       << "  --full-dialects     Register every MLIR dialect up front, rather\n"
+       << "                      than only those that HL modules use\n"
+       << "  --lean-frontend     Build Clang's AST context directly from the\n"
+       << "                      target triple, skipping the Clang frontend\n"
+       << "  --builder <mode>    How expressions are built: `sema` (default),\n"
+       << "                      `trusted` to build them directly from VAST's\n"
+       << "                      types, or `verify` to cross-check the two\n";
+}
+
+// Parse a non-negative count. Returns `std::nullopt` unless all of `val` is a
+// decimal number that fits in an `unsigned`.
+static std::optional<unsigned> ParseCount(string_view arg, const char *val)
+{
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long count = strtoul(val, &end, 10);
+  if (!isdigit(static_cast<unsigned char>(val[0])) || *end || errno ||
+      count > UINT_MAX)
+  {
+    cerr << "Invalid value for option " << arg << ": " << val << "\n";
+    return std::nullopt;
+  }
+  return static_cast<unsigned>(count);
+}
+
+static void ReportCacheStats(const pillar::LiftOptions &options)
+{
+  if (!options.function_cache_dir.empty())
+  {
+    pillar::FunctionCacheStats stats = pillar::ClangModule::CacheStats();
+    cerr << "Function cache: " << stats.hits << " hits, " << stats.misses
+         << " misses\n";
+  }
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
+  pillar::DeserializeOptions deserialize_options;
+  pillar::LiftOptions lift_options;
+  pillar::EmitOptions emit_options;
+  const char *output_path = "-";
+  pillar::BatchOptions batch_options;
+  pillar::ServerOptions server_options;
+  bool batch = false;
+  bool serve = false;
+  bool stream = false;
+  std::vector<std::string> function_names;
+  const char *ir_file_name = nullptr;
+
+  for (int i = 1; i < argc; ++i)
   {
-    cerr << "Missing path to VAST IR module\n";
-    return EXIT_FAILURE;
+    string_view arg = argv[i];
+    auto value = [&](void) -> const char *
+    {
+      if (i + 1 >= argc)
+      {
+        cerr << "Missing value for option " << arg << "\n";
+        return nullptr;
+      }
+      return argv[++i];
+    };
+
+    if (arg == "--batch" || arg == "--output-dir" || arg == "--jobs" ||
+        arg == "--serve" || arg == "--builder" || arg == "--emit" ||
+        arg == "--print-threads" || arg == "--lift-threads" ||
+        arg == "--max-expr-depth" || arg == "--max-request-mib" ||
+        arg == "--function-cache" || arg == "--function" || arg == "-o")
+    {
+      const char *val = value();
+      if (!val)
+      {
+        return EXIT_FAILURE;
+      }
+      if (arg == "--batch")
+      {
+        batch = true;
+        batch_options.inputs = val;
+      }
+      else if (arg == "--serve")
+      {
+        serve = true;
+        server_options.socket_path = val;
+      }
+      else if (arg == "--output-dir")
+      {
+        batch_options.output_dir = val;
+      }
+      else if (arg == "-o")
+      {
+        output_path = val;
+      }
+      else if (arg == "--emit")
+      {
+        string_view mode = val;
+        if (mode == "none")
+        {
+          emit_options.mode = pillar::OutputMode::kNone;
+        }
+        else if (mode == "c")
+        {
+          emit_options.mode = pillar::OutputMode::kCSource;
+        }
+        else if (mode == "ast")
+        {
+          emit_options.mode = pillar::OutputMode::kASTDump;
+        }
+        else if (mode == "json")
+        {
+          emit_options.mode = pillar::OutputMode::kJSONAST;
+        }
+        else if (mode == "pch")
+        {
+          emit_options.mode = pillar::OutputMode::kSerializedAST;
+        }
+        else
+        {
+          cerr << "Unknown output mode: " << mode << "\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else if (arg == "--function")
+      {
+        function_names.emplace_back(val);
+      }
+      else if (arg == "--function-cache")
+      {
+        lift_options.function_cache_dir = val;
+      }
+      else if (arg == "--print-threads" || arg == "--lift-threads" ||
+               arg == "--max-expr-depth" || arg == "--max-request-mib" || arg == "--jobs")
+      {
+        std::optional<unsigned> count = ParseCount(arg, val);
+        if (!count)
+        {
+          return EXIT_FAILURE;
+        }
+        if (arg == "--print-threads")
+        {
+          emit_options.num_threads = count.value();
+        }
+        else if (arg == "--lift-threads")
+        {
+          lift_options.num_lift_threads = count.value();
+        }
+        else if (arg == "--max-expr-depth")
+        {
+          lift_options.max_expression_depth = count.value();
+        }
+        else if (arg == "--max-request-mib")
+        {
+          server_options.max_request_size = uint64_t(count.value()) << 20u;
+        }
+        else
+        {
+          batch_options.num_workers = count.value();
+        }
+      }
+      else if (arg == "--builder")
+      {
+        string_view mode = val;
+        if (mode == "sema")
+        {
+          lift_options.builder_mode = pillar::BuilderMode::kSema;
+        }
+        else if (mode == "trusted")
+        {
+          lift_options.builder_mode = pillar::BuilderMode::kTrusted;
+        }
+        else if (mode == "verify")
+        {
+          lift_options.builder_mode = pillar::BuilderMode::kVerify;
+        }
+        else
+        {
+          cerr << "Unknown builder mode: " << mode << "\n";
+          return EXIT_FAILURE;
+        }
+      }
+      else
+      {
+        cerr << "Unhandled option: " << arg << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+    else if (arg == "--bytecode-cache")
+    {
+      deserialize_options.bytecode_cache = true;
+    }
+    else if (arg == "--lazy-bodies")
+    {
+      deserialize_options.lazy_function_bodies = true;
+    }
+    else if (arg == "--full-dialects")
+    {
+      deserialize_options.full_dialect_registry = true;
+    }
+    else if (arg == "--lean-frontend")
+    {
+      lift_options.lean_frontend = true;
+    }
+    else if (arg == "--stream")
+    {
+      stream = true;
+    }
+    else if (arg == "--index")
+    {
+      emit_options.write_index = true;
+    }
+    else if (arg == "-h" || arg == "--help")
+    {
+      Usage(argv[0]);
+      return EXIT_SUCCESS;
+    }
+    else if (arg.size() > 1 && arg.front() == '-')
+    {
+      cerr << "Unknown option: " << arg << "\n";
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    else if (!ir_file_name)
+    {
+      ir_file_name = argv[i];
+    }
+    else
+    {
+      cerr << "Unexpected argument: " << arg << "\n";
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The library doesn't print what it couldn't lift. Report it on `stderr`,
+  // one whole message at a time, as bodies may be lifted on several threads.
+  static std::mutex diagnostics_lock;
+  lift_options.diagnostic_handler = [](std::string_view message)
+  {
+    std::lock_guard<std::mutex> locker(diagnostics_lock);
+    cerr << message << "\n";
+  };
+
+  // Clang's dumps and serialized ASTs can't include bodies that were printed
+  // by another lifting thread or taken from the function cache, so lift every
+  // body into the AST for them.
+  if (emit_options.mode != pillar::OutputMode::kNone &&
+      emit_options.mode != pillar::OutputMode::kCSource)
+  {
+    lift_options.num_lift_threads = 1u;
+    lift_options.function_cache_dir.clear();
+  }
+
+  if (serve)
+  {
+    if (batch || ir_file_name)
+    {
+      cerr << "Server mode doesn't take input modules on the command line\n";
+      return EXIT_FAILURE;
+    }
+    if (deserialize_options.bytecode_cache || stream ||
+        !function_names.empty() || string_view(output_path) != "-")
+    {
+      cerr << "Server mode doesn't take --bytecode-cache, --stream, "
+           << "--function, or -o\n";
+      return EXIT_FAILURE;
+    }
+    server_options.num_workers = batch_options.num_workers;
+    server_options.deserialize_options = deserialize_options;
+    server_options.lift_options = lift_options;
+    server_options.emit_options = emit_options;
+    const int ret = pillar::RunServer(server_options);
+    ReportCacheStats(lift_options);
+    return ret;
   }
 
-  string ir_file_name = argv[1];
-  ifstream is(ir_file_name);
-  string ir_data;
-  for (string line; getline(is, line); line.clear())
+  if (batch)
   {
-    ir_data.insert(ir_data.end(), line.begin(), line.end());
+    if (ir_file_name)
+    {
+      cerr << "Unexpected argument in batch mode: " << ir_file_name << "\n";
+      return EXIT_FAILURE;
+    }
+    if (batch_options.output_dir.empty())
+    {
+      cerr << "Batch mode requires --output-dir\n";
+      return EXIT_FAILURE;
+    }
+    if (!function_names.empty())
+    {
+      cerr << "Batch mode doesn't take --function\n";
+      return EXIT_FAILURE;
+    }
+    batch_options.stream = stream;
+    batch_options.deserialize_options = deserialize_options;
+    batch_options.lift_options = lift_options;
+    batch_options.emit_options = emit_options;
+    const int ret = pillar::RunBatch(batch_options);
+    ReportCacheStats(lift_options);
+    return ret;
+  }
+
+  if (!ir_file_name)
+  {
+    cerr << "Missing path to VAST IR module\n";
+    Usage(argv[0]);
+    return EXIT_FAILURE;
   }
-  auto maybe_module = pillar::VASTModule::Deserialize(ir_data);
+
+  // A path of `-` reads the module from `stdin`.
+  auto maybe_module = pillar::VASTModule::DeserializeFile(
+      ir_file_name, deserialize_options);
   if (!maybe_module)
   {
     cerr << "Invalid VAST IR module\n";
@@ -41,7 +391,44 @@ int main(int argc, char *argv[])
 
   pillar::VASTModule module = std::move(maybe_module.value());
 
-  auto maybe_ast = pillar::ClangModule::Lift(module);
+  if (!function_names.empty())
+  {
+    auto maybe_ast = pillar::ClangModule::LiftOnDemand(module, lift_options);
+    if (!maybe_ast)
+    {
+      cerr << "Could not lift VAST IR module into an AST\n";
+      return EXIT_FAILURE;
+    }
+    for (const std::string &name : function_names)
+    {
+      if (!maybe_ast->LiftFunction(name))
+      {
+        cerr << "No function named " << name << "\n";
+        return EXIT_FAILURE;
+      }
+    }
+    if (!maybe_ast->Emit(output_path, emit_options))
+    {
+      cerr << "Could not write output to " << output_path << "\n";
+      return EXIT_FAILURE;
+    }
+    ReportCacheStats(lift_options);
+    return EXIT_SUCCESS;
+  }
+
+  if (stream)
+  {
+    if (!pillar::ClangModule::LiftAndEmit(module, output_path, lift_options,
+                                          emit_options))
+    {
+      cerr << "Could not write output to " << output_path << "\n";
+      return EXIT_FAILURE;
+    }
+    ReportCacheStats(lift_options);
+    return EXIT_SUCCESS;
+  }
+
+  auto maybe_ast = pillar::ClangModule::Lift(module, lift_options);
   if (!maybe_ast)
   {
     cerr << "Could not lift VAST IR module into an AST\n";
@@ -50,7 +437,12 @@ int main(int argc, char *argv[])
 
   pillar::ClangModule ast = std::move(maybe_ast.value());
 
-  (void)ast;
+  if (!ast.Emit(output_path, emit_options))
+  {
+    cerr << "Could not write output to " << output_path << "\n";
+    return EXIT_FAILURE;
+  }
 
+  ReportCacheStats(lift_options);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,350 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "Server.h"
+#include "../../include/pillar/Clang.h"
+#include "../../include/pillar/VAST.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace pillar
+{
+  namespace
+  {
+
+    static bool ReadAll(int fd, void *data_, size_t size)
+    {
+      auto data = reinterpret_cast<char *>(data_);
+      while (size)
+      {
+        ssize_t ret = read(fd, data, size);
+        if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        else if (ret <= 0)
+        {
+          return false;
+        }
+        data += ret;
+        size -= static_cast<size_t>(ret);
+      }
+      return true;
+    }
+
+    static bool WriteAll(int fd, const void *data_, size_t size)
+    {
+      auto data = reinterpret_cast<const char *>(data_);
+      while (size)
+      {
+        ssize_t ret = write(fd, data, size);
+        if (ret < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        else if (ret <= 0)
+        {
+          return false;
+        }
+        data += ret;
+        size -= static_cast<size_t>(ret);
+      }
+      return true;
+    }
+
+    static bool ReadSize(int fd, uint64_t &size)
+    {
+      uint8_t bytes[8];
+      if (!ReadAll(fd, bytes, sizeof(bytes)))
+      {
+        return false;
+      }
+      size = 0u;
+      for (unsigned i = 0u; i < 8u; ++i)
+      {
+        size |= static_cast<uint64_t>(bytes[i]) << (i * 8u);
+      }
+      return true;
+    }
+
+    static bool WriteResponse(int fd, bool ok, const std::string &data)
+    {
+      uint8_t header[9];
+      header[0] = ok ? 0u : 1u;
+      const uint64_t size = data.size();
+      for (unsigned i = 0u; i < 8u; ++i)
+      {
+        header[i + 1u] = static_cast<uint8_t>(size >> (i * 8u));
+      }
+      return WriteAll(fd, header, sizeof(header)) &&
+             WriteAll(fd, data.data(), data.size());
+    }
+
+    // Lift one module. Returns the emitted module on success, and an error
+    // message on failure.
+    static bool Decompile(const std::string &data, const ServerOptions &options,
+                          std::string &result)
+    {
+      auto maybe_module =
+          VASTModule::Deserialize(data, options.deserialize_options);
+      if (!maybe_module)
+      {
+        result = "Invalid VAST IR module";
+        return false;
+      }
+
+      auto maybe_ast = ClangModule::Lift(maybe_module.value(),
+                                         options.lift_options);
+      if (!maybe_ast)
+      {
+        result = "Could not lift VAST IR module into an AST";
+        return false;
+      }
+
+      std::ostringstream os;
+      if (!maybe_ast->Emit(os, options.emit_options))
+      {
+        result = "Could not emit the lifted AST";
+        return false;
+      }
+      result = std::move(os).str();
+      return true;
+    }
+
+    // Answer requests from `in_fd` on `out_fd` until the peer hangs up.
+    static void Serve(int in_fd, int out_fd, const ServerOptions &options)
+    {
+      std::string request;
+      std::string response;
+      for (uint64_t size = 0u; ReadSize(in_fd, size);)
+      {
+        if (size > options.max_request_size)
+        {
+          (void)WriteResponse(out_fd, false, "Request is too large");
+          return;
+        }
+
+        // `Deserialize` needs a NUL-terminated buffer for textual modules,
+        // which `std::string` provides.
+        request.resize(static_cast<size_t>(size));
+        if (!ReadAll(in_fd, request.data(), request.size()))
+        {
+          return;
+        }
+
+        const bool ok = Decompile(request, options, response);
+        if (!WriteResponse(out_fd, ok, response))
+        {
+          return;
+        }
+      }
+    }
+
+    // The connections being served, so that shutting down can stop workers
+    // that are waiting on a client for their next request.
+    class Connections
+    {
+    private:
+      std::mutex lock;
+      std::set<int> fds;
+      bool stopping{false};
+
+    public:
+      // Returns `false`, without tracking `fd`, if the server is stopping.
+      bool Add(int fd)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        if (stopping)
+        {
+          return false;
+        }
+        fds.insert(fd);
+        return true;
+      }
+
+      void Remove(int fd)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        fds.erase(fd);
+      }
+
+      bool IsStopping(void)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        return stopping;
+      }
+
+      // Stop reading requests on every connection. A request that was already
+      // read is still answered.
+      void Stop(void)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        stopping = true;
+        for (int fd : fds)
+        {
+          shutdown(fd, SHUT_RD);
+        }
+      }
+    };
+
+    static bool IsTransientAcceptError(int error)
+    {
+      return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+             error == ENOMEM;
+    }
+
+    static int ServeSocket(const ServerOptions &options)
+    {
+      const std::string &path = options.socket_path;
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path))
+      {
+        std::cerr << "Socket path is too long: " << path << "\n";
+        return EXIT_FAILURE;
+      }
+      std::memcpy(addr.sun_path, path.c_str(), path.size() + 1u);
+
+      // Clean up a stale socket left behind by a previous server.
+      struct stat info = {};
+      if (!lstat(path.c_str(), &info) && S_ISSOCK(info.st_mode))
+      {
+        unlink(path.c_str());
+      }
+
+      int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listen_fd < 0 ||
+          bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+          listen(listen_fd, SOMAXCONN))
+      {
+        std::cerr << "Could not listen on " << path << ": "
+                  << std::strerror(errno) << "\n";
+        if (listen_fd >= 0)
+        {
+          close(listen_fd);
+        }
+        return EXIT_FAILURE;
+      }
+
+      // Only this thread handles the stop signals; the workers inherit the
+      // blocked mask.
+      sigset_t stop_signals;
+      sigset_t old_signals;
+      sigemptyset(&stop_signals);
+      sigaddset(&stop_signals, SIGINT);
+      sigaddset(&stop_signals, SIGTERM);
+      pthread_sigmask(SIG_BLOCK, &stop_signals, &old_signals);
+
+      Connections connections;
+      std::atomic<bool> failed{false};
+
+      // A fixed pool of workers accepts connections, so one slow client
+      // doesn't hold up the others, while the number of threads and of
+      // buffered requests stays bounded. The process-wide LLVM, MLIR, and
+      // Clang state stays warm across all of them.
+      auto worker = [&](void)
+      {
+        for (;;)
+        {
+          int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+          if (fd < 0)
+          {
+            const int error = errno;
+            if (connections.IsStopping())
+            {
+              return;
+            }
+            else if (error == EINTR || error == ECONNABORTED)
+            {
+              continue;
+            }
+            else if (IsTransientAcceptError(error))
+            {
+              std::this_thread::sleep_for(std::chrono::milliseconds(100));
+              continue;
+            }
+            std::cerr << "Could not accept connection: "
+                      << std::strerror(error) << "\n";
+            failed.store(true);
+            kill(getpid(), SIGTERM);
+            return;
+          }
+
+          if (connections.Add(fd))
+          {
+            Serve(fd, fd, options);
+            connections.Remove(fd);
+          }
+          close(fd);
+        }
+      };
+
+      const unsigned num_workers = std::max(
+          1u, options.num_workers ? options.num_workers
+                                  : std::thread::hardware_concurrency());
+      std::vector<std::thread> workers;
+      workers.reserve(num_workers);
+      for (unsigned i = 0u; i < num_workers; ++i)
+      {
+        workers.emplace_back(worker);
+      }
+
+      for (int signal = 0; sigwait(&stop_signals, &signal);)
+      {
+      }
+
+      // Shutting down the listening socket wakes up the workers blocked in
+      // `accept4`.
+      connections.Stop();
+      shutdown(listen_fd, SHUT_RDWR);
+      for (std::thread &thread : workers)
+      {
+        thread.join();
+      }
+
+      close(listen_fd);
+      unlink(path.c_str());
+      pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+      return failed.load() ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+  } // namespace
+
+  int RunServer(const ServerOptions &options)
+  {
+    // A client hanging up mid-response shouldn't kill the server.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    if (options.socket_path == "-")
+    {
+      Serve(STDIN_FILENO, STDOUT_FILENO, options);
+      return EXIT_SUCCESS;
+    }
+
+    return ServeSocket(options);
+  }
+
+} // namespace pillar
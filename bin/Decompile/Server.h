@@ -0,0 +1,54 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include "../../include/pillar/Clang.h"
+#include "../../include/pillar/VAST.h"
+
+#include <cstdint>
+#include <string>
+
+namespace pillar
+{
+
+  // Requests and responses are framed the same way on both the socket and on
+  // `stdin`/`stdout`. A request is a module (textual MLIR or MLIR bytecode):
+  //
+  //      u64 size (little endian) | u8 data[size]
+  //
+  // And a response is a status byte (zero on success) followed by either the
+  // lifted module, in the form chosen by `emit_options`, or an error message:
+  //
+  //      u8 status | u64 size (little endian) | u8 data[size]
+  //
+  // Any number of requests can be sent over one connection.
+  struct ServerOptions
+  {
+    // Path of the Unix domain socket to listen on, or `-` to serve requests
+    // from `stdin` and write responses to `stdout`.
+    std::string socket_path;
+
+    // Number of connections served at once on the socket; further clients
+    // wait to be accepted. Zero means one per hardware thread.
+    unsigned num_workers{0u};
+
+    // Each connection buffers a whole request before lifting it, so larger
+    // requests are refused, and the connection is closed.
+    uint64_t max_request_size{uint64_t(1) << 30u};
+
+    DeserializeOptions deserialize_options;
+    LiftOptions lift_options;
+    EmitOptions emit_options;
+  };
+
+  // Serve decompilation requests until `stdin` is closed, or, when listening
+  // on a socket, until the process receives `SIGINT` or `SIGTERM`. Requests
+  // that were already read are answered before returning, and the socket is
+  // removed. Returns a process exit code.
+  int RunServer(const ServerOptions &options);
+
+} // namespace pillar
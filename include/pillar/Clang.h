@@ -6,9 +6,14 @@
 
 #pragma once
 
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
+#include <vector>
 
 namespace vast
 {
@@ -20,6 +25,103 @@ namespace pillar
   class ClangModuleImpl;
   class VASTModule;
 
+  // How lifted expressions and conditions are built.
+  enum class BuilderMode
+  {
+    // Go through Clang's `Sema`, which re-derives result types, and re-checks
+    // operands, even though VAST already made every conversion explicit.
+    kSema,
+
+    // Trust the input, and create AST nodes directly, with result types taken
+    // from the HL operations.
+    kTrusted,
+
+    // Build every node both ways, report any disagreement between the two on
+    // `stderr`, and keep the one built by `Sema`.
+    kVerify,
+  };
+
+  struct LiftOptions
+  {
+    // Build the empty translation unit that declarations are lifted into by
+    // constructing Clang's `ASTContext` and `Sema` directly from the target
+    // triple, rather than by running Clang's frontend over an empty file.
+    bool lean_frontend{false};
+
+    BuilderMode builder_mode{BuilderMode::kSema};
+
+    // If not empty, a directory in which to cache the C code lifted for each
+    // function, keyed by a hash of the function's HL and everything else that
+    // affects how it's lifted. The bodies of functions found in the cache
+    // aren't lifted again; their cached code is spliced into C source output.
+    // Other outputs can't include that code, so emitting them fails.
+    std::string function_cache_dir;
+
+    // Number of threads that lift function bodies. Every thread lifts the
+    // module's declarations into its own Clang AST, and then lifts and prints
+    // a share of the bodies; the result doesn't depend on the number of
+    // threads. As with cached functions, emitting anything other than C
+    // source code fails when bodies were lifted this way. Zero means one per
+    // hardware thread. Streaming always lifts on one thread.
+    unsigned num_lift_threads{1u};
+
+    // How deeply expressions may nest before an intermediate value is stored
+    // in a temporary variable (`__pillar_tmp_<n>`) declared just before the
+    // statement that uses it. This keeps machine-generated chains of
+    // thousands of operations from overflowing the stack when they're
+    // printed. Values in loop conditions and increments, and in the
+    // initializers of global variables, are never moved into temporaries,
+    // because that would change when they're evaluated. Zero means no limit.
+    unsigned max_expression_depth{256u};
+
+    // Called with a message about each operation, attribute, or type that
+    // couldn't be lifted, and, with `BuilderMode::kVerify`, about each
+    // expression on which the trusted builders and `Sema` disagree. It's
+    // called from every lifting thread, possibly at the same time. The
+    // library never prints these itself; without a handler, they're dropped.
+    std::function<void(std::string_view)> diagnostic_handler;
+  };
+
+  struct FunctionCacheStats
+  {
+    uint64_t hits{0u};
+    uint64_t misses{0u};
+  };
+
+  enum class OutputMode
+  {
+    // Don't write anything.
+    kNone,
+
+    // The translation unit, printed as C source code.
+    kCSource,
+
+    // Clang's textual AST dump, as with `clang -Xclang -ast-dump`.
+    kASTDump,
+
+    // Clang's JSON AST dump, as with `clang -Xclang -ast-dump=json`.
+    kJSONAST,
+
+    // Clang's serialized AST, as with `clang -emit-ast`. Tools can load this
+    // with `clang::ASTUnit::LoadFromASTFile` rather than re-parsing C code.
+    kSerializedAST,
+  };
+
+  struct EmitOptions
+  {
+    OutputMode mode{OutputMode::kCSource};
+
+    // Number of threads used to print C source code. Top-level declarations
+    // are printed concurrently, and the output is the same regardless of the
+    // number of threads. Zero means one per hardware thread.
+    unsigned num_threads{1u};
+
+    // When writing C source code to a file, also write an index of where each
+    // function, global variable, and record is defined in it to `<path>.idx`.
+    // The format is described in `pillar/Index.h`.
+    bool write_index{false};
+  };
+
   class ClangModule
   {
     friend class VASTModule;
@@ -37,7 +139,82 @@ namespace pillar
     ClangModule(ClangModule &&) noexcept = default;
     ClangModule &operator=(ClangModule &&) noexcept = default;
 
-    static std::optional<ClangModule> Lift(const VASTModule &module);
+    static std::optional<ClangModule> Lift(const VASTModule &module,
+                                           const LiftOptions &options = {});
+
+    // Create a translation unit for `module` into which nothing has been
+    // lifted yet. Functions are lifted into it one at a time by
+    // `LiftFunction`, which keeps `module` alive.
+    static std::optional<ClangModule> LiftOnDemand(
+        const VASTModule &module, const LiftOptions &options = {});
+
+    // Lift `module` and write it, in the form chosen by `emit_options`, to the
+    // file at `path`, or to `stdout` if `path` is `-`. C source code is
+    // streamed: every declaration is written first, and then each function
+    // definition is written as soon as it's lifted, after which the lifting
+    // state for its body is dropped. Other outputs are lifted on one thread
+    // and without the function cache, so that they include every body.
+    // Returns `false` if the file couldn't be written.
+    static bool LiftAndEmit(const VASTModule &module, std::string_view path,
+                            const LiftOptions &lift_options = {},
+                            const EmitOptions &emit_options = {});
+
+    // Initialize the LLVM backend for `triple`, or for the host if `triple` is
+    // empty. Lifting a module initializes the backend for the module's target
+    // triple on demand, so this only needs to be called to pay that cost up
+    // front. Returns `false` if LLVM has no backend for `triple`.
+    static bool InitializeTarget(std::string_view triple);
+
+    // Initialize every LLVM backend.
+    static void InitializeAllTargets(void);
+
+    // Totals of the function cache lookups made so far by this process.
+    static FunctionCacheStats CacheStats(void);
+
+    // Lift the function named `name`, along with only the global variables
+    // that it references, directly or through their initializers. Anything
+    // lifted by an earlier call is reused, and the module's functions are
+    // indexed by name on the first call, so the cost of a call depends on the
+    // function rather than on the size of the module. Returns `false` if the
+    // module has no function named `name`.
+    bool LiftFunction(std::string_view name);
+
+    // Bring the translation unit up to date with `revision`, a later version
+    // of the module that it was lifted from, or that module itself after it
+    // was edited in place. What was lifted is fingerprinted as it's lifted,
+    // and compared against the revision. When the revision only adds,
+    // removes, or changes functions, only the added and changed functions
+    // are lifted, and everything else is kept; functions that are added go
+    // after the existing declarations. Otherwise, the same parts of the
+    // revision are lifted from scratch as were lifted from the module.
+    // Returns `false`, leaving the translation unit as it was, if the revision
+    // couldn't be lifted.
+    bool Update(const VASTModule &revision);
+
+    // Lift the functions named `names` again, after they were edited in place
+    // in the module that was last lifted or updated from. Only those functions
+    // are looked at. Returns `false` if any of `names` isn't a function that
+    // was lifted; the others are still lifted again.
+    bool Relift(const std::vector<std::string> &names);
+
+    // Print the lifted translation unit as C source code to `os`.
+    void Print(std::ostream &os) const;
+
+    // Write the lifted translation unit, in the form chosen by `options`, to
+    // the file at `path`, or to `stdout` if `path` is `-`. Output is buffered
+    // in large blocks. Returns `false` if the file couldn't be written, or if
+    // `options` asks for something other than C source code and some bodies
+    // only exist as printed C (see `LiftOptions`).
+    bool Emit(std::string_view path, const EmitOptions &options = {}) const;
+
+    // Write the lifted translation unit to the open file descriptor `fd`,
+    // which is left open. Returns `false` if writing failed.
+    bool Emit(int fd, const EmitOptions &options = {}) const;
+
+    // Write the lifted translation unit, in the form chosen by `options`, to
+    // `os`. Unlike `Print`, this reports failure: returns `false` if writing
+    // failed, or for the same reasons as the other overloads.
+    bool Emit(std::ostream &os, const EmitOptions &options = {}) const;
   };
 
 } // namespace pillar
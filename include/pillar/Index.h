@@ -0,0 +1,189 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+namespace pillar
+{
+
+  // An index of where each top-level function, global variable, and record is
+  // defined in a C file written by pillar, so that consumers can pull single
+  // declarations out of huge files without scanning them. The index for
+  // `<file>.c` is written to `<file>.c.idx`.
+  //
+  // The file is designed to be memory-mapped and used in place. All integers
+  // are little-endian, and every section is 8-byte aligned. It contains, in
+  // order:
+  //
+  //    IndexHeader   header;
+  //    uint64_t      buckets[header.num_buckets + 1];
+  //    IndexEntry    entries[header.num_entries];
+  //    char          names[];
+  //
+  // Entries are a hash table, grouped by bucket: the entries whose kinds and
+  // names hash (with `IndexHash`) to bucket `hash % num_buckets` are
+  // `entries[buckets[b]]` through `entries[buckets[b + 1] - 1]`. A name is
+  // `names[name_offset]` through `names[name_offset + name_length - 1]`, and
+  // isn't NUL-terminated. Records are tags, which C keeps apart from the
+  // names of functions and variables, so `struct stat` and `stat` get an
+  // entry each. Each kind and name appears once; where a name is both
+  // declared and defined, its entry is for the definition.
+
+  enum class IndexKind : uint32_t
+  {
+    kFunction = 1u,
+    kGlobal = 2u,
+    kRecord = 3u,
+  };
+
+  struct IndexHeader
+  {
+    // `kIndexMagic`.
+    char magic[8];
+
+    // `kIndexVersion`.
+    uint32_t version;
+    uint32_t num_buckets;
+    uint64_t num_entries;
+
+    // Offset of `names` from the beginning of the file.
+    uint64_t names_offset;
+  };
+
+  struct IndexEntry
+  {
+    uint64_t name_hash;
+    uint64_t name_offset;
+    uint32_t name_length;
+    IndexKind kind;
+
+    // Byte range of the declaration's code in the C file, including the
+    // terminating `;` or `}` and newline.
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  static_assert(sizeof(IndexHeader) == 32u);
+  static_assert(sizeof(IndexEntry) == 40u);
+
+  static constexpr char kIndexMagic[8] = {'P', 'I', 'L', 'L', 'A', 'R', 'I', 'X'};
+  static constexpr uint32_t kIndexVersion = 2u;
+
+  // 64-bit FNV-1a of `kind`, as a little-endian `uint32_t`, followed by
+  // `name`.
+  inline uint64_t IndexHash(IndexKind kind, std::string_view name)
+  {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](uint8_t byte)
+    {
+      hash ^= byte;
+      hash *= 0x100000001b3ull;
+    };
+    for (unsigned i = 0u; i < sizeof(uint32_t); ++i)
+    {
+      mix(static_cast<uint8_t>(static_cast<uint32_t>(kind) >> (i * 8u)));
+    }
+    for (char c : name)
+    {
+      mix(static_cast<uint8_t>(c));
+    }
+    return hash;
+  }
+
+  // Read the little-endian integer at `data`, which need not be aligned.
+  template <typename T>
+  inline T ReadIndexInt(const void *data)
+  {
+    unsigned char bytes[sizeof(T)];
+    std::memcpy(bytes, data, sizeof(T));
+    T val = 0u;
+    for (size_t i = sizeof(T); i-- > 0u;)
+    {
+      val = static_cast<T>((val << 8u) | bytes[i]);
+    }
+    return val;
+  }
+
+  // Find the entry for the `kind` of declaration named `name` in the index
+  // `data` of `size` bytes. The fields of the returned entry are in host byte
+  // order. Returns `std::nullopt` if the index is malformed or has no such
+  // entry.
+  inline std::optional<IndexEntry> FindInIndex(const void *data, size_t size,
+                                               IndexKind kind,
+                                               std::string_view name)
+  {
+    auto bytes = reinterpret_cast<const char *>(data);
+    if (size < sizeof(IndexHeader) ||
+        std::memcmp(bytes + offsetof(IndexHeader, magic), kIndexMagic,
+                    sizeof(kIndexMagic)) ||
+        ReadIndexInt<uint32_t>(bytes + offsetof(IndexHeader, version)) !=
+            kIndexVersion)
+    {
+      return std::nullopt;
+    }
+
+    const uint64_t num_buckets =
+        ReadIndexInt<uint32_t>(bytes + offsetof(IndexHeader, num_buckets));
+    const uint64_t num_entries =
+        ReadIndexInt<uint64_t>(bytes + offsetof(IndexHeader, num_entries));
+    const uint64_t names_offset =
+        ReadIndexInt<uint64_t>(bytes + offsetof(IndexHeader, names_offset));
+    if (!num_buckets || num_entries > size / sizeof(IndexEntry))
+    {
+      return std::nullopt;
+    }
+
+    const size_t buckets_size = (num_buckets + 1u) * sizeof(uint64_t);
+    const size_t entries_size = num_entries * sizeof(IndexEntry);
+    if (size < sizeof(IndexHeader) + buckets_size + entries_size ||
+        names_offset > size)
+    {
+      return std::nullopt;
+    }
+
+    const char *buckets = bytes + sizeof(IndexHeader);
+    const char *entries = buckets + buckets_size;
+    const char *names = bytes + names_offset;
+    const size_t names_size = size - names_offset;
+
+    const uint64_t hash = IndexHash(kind, name);
+    const uint64_t bucket = hash % num_buckets;
+    for (uint64_t i = ReadIndexInt<uint64_t>(buckets + bucket * sizeof(uint64_t)),
+                  max_i = ReadIndexInt<uint64_t>(
+                      buckets + (bucket + 1u) * sizeof(uint64_t));
+         i < max_i && i < num_entries; ++i)
+    {
+      const char *raw = entries + i * sizeof(IndexEntry);
+      IndexEntry entry = {};
+      entry.name_hash =
+          ReadIndexInt<uint64_t>(raw + offsetof(IndexEntry, name_hash));
+      entry.name_offset =
+          ReadIndexInt<uint64_t>(raw + offsetof(IndexEntry, name_offset));
+      entry.name_length =
+          ReadIndexInt<uint32_t>(raw + offsetof(IndexEntry, name_length));
+      entry.kind = static_cast<IndexKind>(
+          ReadIndexInt<uint32_t>(raw + offsetof(IndexEntry, kind)));
+      entry.offset = ReadIndexInt<uint64_t>(raw + offsetof(IndexEntry, offset));
+      entry.length = ReadIndexInt<uint64_t>(raw + offsetof(IndexEntry, length));
+      if (entry.name_hash == hash && entry.kind == kind &&
+          entry.name_length == name.size() &&
+          entry.name_offset <= names_size &&
+          entry.name_length <= names_size - entry.name_offset &&
+          !std::memcmp(names + entry.name_offset, name.data(), name.size()))
+      {
+        return entry;
+      }
+    }
+    return std::nullopt;
+  }
+
+} // namespace pillar
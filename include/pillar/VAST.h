@@ -20,6 +20,26 @@ namespace pillar
   class ClangModule;
   class VASTModuleImpl;
 
+  struct DeserializeOptions
+  {
+    // When reading a textual module from a file, prefer an MLIR bytecode
+    // sidecar (`<path>.mlirbc`) if one was made from exactly the same text
+    // (matched by size and content hash), and otherwise write one after the
+    // textual parse succeeds, so that later runs skip text parsing.
+    bool bytecode_cache{false};
+
+    // When the input is MLIR bytecode (including a bytecode sidecar), only read
+    // the top level of the module up front, and defer materializing each
+    // function body until it is first lifted. Textual input is always parsed
+    // eagerly.
+    bool lazy_function_bodies{false};
+
+    // Register every MLIR dialect with the context up front. By default, only
+    // the dialects that HL modules produced by VAST use are registered, and
+    // the rest are registered only if parsing with those alone fails.
+    bool full_dialect_registry{false};
+  };
+
   class VASTModule
   {
     friend class ClangModule;
@@ -37,7 +57,22 @@ namespace pillar
     VASTModule(VASTModule &&) noexcept = default;
     VASTModule &operator=(VASTModule &&) noexcept = default;
 
-    static std::optional<VASTModule> Deserialize(std::string_view data);
+    // Deserialize a module from `data`, which may be either textual MLIR or
+    // MLIR bytecode. `data` need not outlive the call. `bytecode_cache` only
+    // applies to files, and is ignored.
+    static std::optional<VASTModule> Deserialize(
+        std::string_view data, const DeserializeOptions &options = {});
+
+    // Deserialize the module stored in the file at `path`. The file is memory
+    // mapped and handed to the MLIR parser without being copied. A `path` of
+    // `-` reads the module from `stdin` into a single buffer. Both textual MLIR
+    // and MLIR bytecode are accepted.
+    static std::optional<VASTModule> DeserializeFile(
+        std::string_view path, const DeserializeOptions &options = {});
+
+    // Write this module out as MLIR bytecode to the file at `path`. Returns
+    // `false` on failure.
+    bool SerializeBytecode(std::string_view path) const;
   };
 
 } // namespace pillar
@@ -5,6 +5,7 @@
 // the LICENSE file found in the root directory of this source tree.
 
 #include "AST.h"
+#include "ClangFactory.h"
 #include <clang/AST/ASTContext.h>
 #include <clang/AST/Decl.h>
 #include <clang/AST/PrettyPrinter.h>
@@ -14,19 +15,123 @@
 #include <clang/Sema/Lookup.h>
 #include <clang/Sema/Sema.h>
 #include <vast/Util/TypeSwitch.hpp>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/ADT/TypeSwitch.h>
 
+#include <algorithm>
+#include <atomic>
+#include <optional>
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
 #pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
 #pragma GCC diagnostic ignored "-Wsign-conversion"
 #pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <mlir/IR/Threading.h>
 #pragma GCC diagnostic pop
 
 namespace pillar
 {
   namespace ast
   {
+    namespace
+    {
+
+      // Append the key of `op`, followed by those of every operation and block
+      // argument nested inside of it, in the order that
+      // `LiftTable::NumberNested` numbers them.
+      static void AppendKeys(mlir::Operation *op,
+                             std::vector<const void *> &keys)
+      {
+        keys.push_back(op);
+        op->walk([&](mlir::Block *block)
+                 {
+                   for (mlir::BlockArgument arg : block->getArguments())
+                   {
+                     keys.push_back(arg.getAsOpaquePointer());
+                   }
+                   for (mlir::Operation &nested_op : *block)
+                   {
+                     keys.push_back(&nested_op);
+                   } });
+      }
+
+      // Results are found through the operations that define them, and block
+      // arguments by themselves.
+      static const void *KeyOf(mlir::Value val)
+      {
+        if (mlir::Operation *op = val.getDefiningOp())
+        {
+          return op;
+        }
+        return val.getAsOpaquePointer();
+      }
+
+      static uint64_t FingerprintAttributes(mlir::Operation *op)
+      {
+        std::string text;
+        llvm::raw_string_ostream os(text);
+        op->getAttrDictionary().print(os);
+        os.flush();
+        return llvm::xxh3_64bits(llvm::ArrayRef<uint8_t>(
+            reinterpret_cast<const uint8_t *>(text.data()), text.size()));
+      }
+
+    } // namespace
+
+    void LiftTable::NumberNested(mlir::Operation *op)
+    {
+      size_t count = 0u;
+      op->walk([&](mlir::Block *block)
+               { count += block->getNumArguments() +
+                          block->getOperations().size(); });
+      index.reserve(index.size() + count);
+      entries.reserve(entries.size() + count);
+
+      op->walk([this](mlir::Block *block)
+               {
+                 for (mlir::BlockArgument arg : block->getArguments())
+                 {
+                   (void)Insert(arg.getAsOpaquePointer());
+                 }
+                 for (mlir::Operation &nested_op : *block)
+                 {
+                   Entry &entry = Insert(&nested_op);
+                   entry.kind = KindOf(nested_op);
+                   entry.classified = true;
+                 } });
+    }
+
+    LiftTable::Entry *LiftTable::Find(const void *key)
+    {
+      if (auto it = index.find(key); it != index.end())
+      {
+        return &(entries[it->second]);
+      }
+      return nullptr;
+    }
+
+    LiftTable::Entry &LiftTable::Insert(const void *key)
+    {
+      auto [it, added] =
+          index.try_emplace(key, static_cast<unsigned>(entries.size()));
+      if (added)
+      {
+        entries.emplace_back();
+      }
+      return entries[it->second];
+    }
+
+    void LiftTable::Clear(void)
+    {
+      index.clear();
+      entries.clear();
+    }
+
     void AST::AddToLiftQueue(std::function<void(void)> lift)
     {
       lift_queue.emplace_back(lift);
@@ -44,11 +149,35 @@ namespace pillar
       }
     }
 
-    AST::AST(const llvm::Triple &triple, std::shared_ptr<mlir::Operation> op_)
-        : ClangModuleImpl(triple),
+    // Everything besides a function's HL that changes the C code lifted from
+    // it: the target decides the sizes and signedness of types, and the
+    // builder and the frontend decide the exact nodes and printing policy.
+    static std::unique_ptr<FunctionCache> CreateFunctionCache(
+        const llvm::Triple &triple, const LiftOptions &options)
+    {
+      if (options.function_cache_dir.empty())
+      {
+        return nullptr;
+      }
+
+      std::string salt = triple.normalize();
+      salt += ":builder=" + std::to_string(static_cast<int>(options.builder_mode));
+      salt += ":lean=" + std::to_string(options.lean_frontend);
+      salt += ":depth=" + std::to_string(options.max_expression_depth);
+      return std::make_unique<FunctionCache>(options.function_cache_dir,
+                                             std::move(salt));
+    }
+
+    AST::AST(const llvm::Triple &triple, std::unique_ptr<ClangUnit> unit_,
+             std::shared_ptr<VASTModuleImpl> vast_module_,
+             const LiftOptions &options)
+        : ClangModuleImpl(std::move(unit_), options),
           char_is_unsigned(CharIsUnsigned()),
-          module(std::move(op_)),
-          dl(mlir::dyn_cast<mlir::ModuleOp>(module.get())) {}
+          vast_module(std::move(vast_module_)),
+          module(vast_module, vast_module->module->getOperation()),
+          dl(std::in_place, mlir::dyn_cast<mlir::ModuleOp>(module.get())),
+          lift_options(options),
+          function_cache(CreateFunctionCache(triple, options)) {}
 
     bool AST::ElideFromCompoundStmt(mlir::Operation &op, clang::Stmt *stmt)
     {
@@ -66,11 +195,11 @@ namespace pillar
       }
     }
 
-    std::shared_ptr<AST> AST::CreateFromModule(
-        std::shared_ptr<mlir::Operation> op)
+    std::shared_ptr<AST> AST::CreateEmpty(
+        std::shared_ptr<VASTModuleImpl> vast_module,
+        const LiftOptions &options)
     {
-      mlir::Operation *currentOp = op.get();
-      auto moduleOp = dyn_cast<mlir::ModuleOp>(currentOp);
+      mlir::ModuleOp moduleOp = vast_module->module.get();
       auto triple_attr = moduleOp->getAttrOfType<mlir::StringAttr>("vast.core.target_triple");
 
       llvm::Triple triple;
@@ -78,81 +207,864 @@ namespace pillar
       {
         triple = llvm::Triple(triple_attr.getValue().str());
       }
-      std::shared_ptr<AST> ast = std::make_shared<ast::AST>(triple, std::move(op));
+
+      std::unique_ptr<ClangUnit> unit = CreateUnit(triple, options);
+      if (!unit)
+      {
+        return nullptr;
+      }
+
+      return std::make_shared<ast::AST>(triple, std::move(unit),
+                                        std::move(vast_module), options);
+    }
+
+    std::shared_ptr<AST> AST::CreateDeclsFromModule(
+        std::shared_ptr<VASTModuleImpl> vast_module,
+        const LiftOptions &options)
+    {
+      mlir::ModuleOp moduleOp = vast_module->module.get();
+      std::shared_ptr<AST> ast = CreateEmpty(std::move(vast_module), options);
+      if (!ast)
+      {
+        return nullptr;
+      }
+
       clang::TranslationUnitDecl *tu = ast->ctx.getTranslationUnitDecl();
 
-      ///////
+      // Function bodies are numbered when they're lifted.
+      for (mlir::Operation &op : moduleOp.getBody()->getOperations())
+      {
+        (void)ast->module_table.Insert(&op);
+        if (!mlir::isa<vast::hl::FuncOp>(op))
+        {
+          ast->module_table.NumberNested(&op);
+        }
+      }
+
       for (mlir::Operation &op : moduleOp.getBody()->getOperations())
       {
-        // Print the operation name.
-        llvm::TypeSwitch<mlir::Operation *>(&op)
-            .Case([&](vast::hl::FuncOp func_op)
-                  { (void)ast->LiftFuncOp(tu, tu, func_op); })
-            .Case([&](vast::hl::VarDeclOp var_op)
-                  { (void)ast->LiftVarDeclOp(tu, tu, var_op); })
-            .Case([&](vast::hl::TypeDefOp ty_def_op)
-                  { (void)ast->LiftTypeDefOp(tu, tu, ty_def_op); })
-            .Case([&](vast::hl::StructDeclOp strct_op)
-                  { (void)ast->LiftStructOp(tu, tu, strct_op); })
-            // .Case([&](vast::hl::EnumDeclOp enum_op) {})
-            // .Case([&](vast::hl::ClassDeclOp class_op) {})
-            .Default([&](mlir::Operation *)
-                     { std::cout << "No handler for: " << op.getName().getStringRef().str() << "\n"; });
+        (void)ast->LiftDeclaration(op);
       }
+      ast->whole_module = true;
 
-      for (size_t i = 0; i < ast->lift_queue.size(); i++)
+      ast->DrainLiftQueue();
+
+      // Only global variables have anything to parenthesize so far.
+      for (clang::Decl *decl : tu->decls())
       {
-        ast->lift_queue[i]();
+        ast->Parenthesize(decl);
       }
 
-      tu->dumpColor();
-      tu->print(llvm::errs());
       return ast;
     }
 
+    std::shared_ptr<AST> AST::CreateFromModule(
+        std::shared_ptr<VASTModuleImpl> vast_module,
+        const LiftOptions &options)
+    {
+      std::shared_ptr<AST> ast =
+          CreateDeclsFromModule(std::move(vast_module), options);
+      if (!ast)
+      {
+        return nullptr;
+      }
+
+      // Only a module lifted this way can be updated later, so this is where
+      // it's fingerprinted, rather than for every worker AST or stream.
+      mlir::ModuleOp module_op = ast->vast_module->module.get();
+      std::vector<vast::hl::FuncOp> funcs;
+      for (mlir::Operation &op : module_op.getBody()->getOperations())
+      {
+        if (auto func = mlir::dyn_cast<vast::hl::FuncOp>(op))
+        {
+          funcs.push_back(func);
+        }
+      }
+      ast->fingerprint = FingerprintDecls(module_op);
+      ast->RecordFingerprints(funcs);
+
+      if (options.num_lift_threads != 1u)
+      {
+        ast->LiftBodiesInParallel(options.num_lift_threads);
+      }
+      ast->AnalyzeBodies();
+      while (ast->LiftNextBody())
+      {
+      }
+      return ast;
+    }
+
+    clang::FunctionDecl *AST::LiftNextBody(void)
+    {
+      if (next_body == body_queue.size())
+      {
+        body_queue.clear();
+        next_body = 0u;
+        return nullptr;
+      }
+
+      PendingBody pending = std::move(body_queue[next_body++]);
+      LiftBody(pending);
+      return pending.decl;
+    }
+
+    void AST::LiftBody(PendingBody &pending)
+    {
+      // If the module was read lazily, then the body won't be there until we
+      // materialize it.
+      mlir::Operation *op = pending.func.getOperation();
+      if (!vast_module->Materialize(op))
+      {
+        assert(false);
+        return;
+      }
+
+      mlir::Region &body = pending.func.getBody();
+      std::optional<uint64_t> cache_key;
+      if (pending.summary)
+      {
+        cache_key = pending.summary->cache_key;
+      }
+      else if (function_cache && body.hasOneBlock())
+      {
+        cache_key = function_cache->Key(op);
+      }
+      if (cache_key)
+      {
+        if (auto code = function_cache->Find(cache_key.value()))
+        {
+          printed_definitions.try_emplace(pending.decl, std::move(code.value()));
+          return;
+        }
+      }
+
+      // Number everything in the function, and expose its arguments.
+      if (pending.summary)
+      {
+        function_table = std::move(pending.summary->table);
+        pending.summary.reset();
+      }
+      else
+      {
+        function_table.NumberNested(op);
+      }
+      if (body.hasOneBlock())
+      {
+        for (unsigned i = 0u, max_i = body.getNumArguments(); i < max_i; ++i)
+        {
+          function_table.Insert(body.getArgument(i).getAsOpaquePointer())
+              .decl = pending.decl->getParamDecl(i);
+        }
+      }
+
+      num_temporaries = 0u;
+      pending.lift();
+
+      // Lifting the body queues up the initializers of its local variables.
+      DrainLiftQueue();
+      Parenthesize(pending.decl);
+      ForgetBody();
+
+      if (cache_key && pending.decl->doesThisDeclarationHaveABody())
+      {
+        std::string code;
+        llvm::raw_string_ostream os(code);
+        pending.decl->print(os, ctx.getPrintingPolicy(), /*Indentation=*/0u);
+        os.flush();
+        function_cache->Store(cache_key.value(), code);
+      }
+    }
+
+    void AST::AnalyzeBodies(void)
+    {
+      if (next_body == body_queue.size())
+      {
+        return;
+      }
+
+      // Reading in bodies changes the module, so do it before any thread
+      // looks at the module.
+      for (size_t i = next_body; i < body_queue.size(); ++i)
+      {
+        if (!vast_module->Materialize(body_queue[i].func.getOperation()))
+        {
+          assert(false);
+          return;
+        }
+      }
+
+      // Hashing a function for the cache prints it, and numbering a function
+      // hashes every operation in it, so both are worth spreading across
+      // threads. The summaries are consumed in queue order, and don't depend
+      // on which thread made them.
+      mlir::parallelForEach(
+          &(vast_module->context), body_queue.begin() + next_body,
+          body_queue.end(), [this](PendingBody &pending)
+          {
+            auto summary = std::make_unique<BodySummary>();
+            mlir::Operation *op = pending.func.getOperation();
+            if (function_cache && pending.func.getBody().hasOneBlock())
+            {
+              summary->cache_key = function_cache->Key(op);
+            }
+            summary->table.NumberNested(op);
+            pending.summary = std::move(summary); });
+    }
+
+    void AST::LiftBodiesInParallel(unsigned num_threads)
+    {
+      const size_t first = next_body;
+      const size_t num_bodies = body_queue.size() - first;
+      llvm::ThreadPoolStrategy strategy = llvm::hardware_concurrency(num_threads);
+      const unsigned num_workers = static_cast<unsigned>(std::min<size_t>(
+          strategy.compute_thread_count(), num_bodies));
+      if (num_workers < 2u)
+      {
+        return;
+      }
+
+      // The workers read the module concurrently, so read in every body up
+      // front, rather than having them change the module as they go.
+      for (size_t i = first; i < body_queue.size(); ++i)
+      {
+        if (!vast_module->Materialize(body_queue[i].func.getOperation()))
+        {
+          assert(false);
+          return;
+        }
+      }
+
+      // Neither Clang's `ASTContext` nor its `Sema` are thread-safe, so every
+      // worker lifts the module's declarations into an AST of its own, and
+      // then lifts and prints whichever bodies it claims. Every worker's queue
+      // holds the same functions in the same order as ours. What gets printed
+      // for a function doesn't depend on which worker lifted it, so the
+      // output doesn't depend on the number of threads. A worker that can't
+      // set up its AST claims nothing, and any bodies left unclaimed stay in
+      // our queue for `LiftNextBody`.
+      LiftOptions worker_options = lift_options;
+      worker_options.num_lift_threads = 1u;
+
+      std::vector<std::optional<std::string>> definitions(num_bodies);
+      std::atomic<size_t> next_claim{0u};
+      {
+        llvm::ThreadPool pool(strategy);
+        for (unsigned w = 0u; w < num_workers; ++w)
+        {
+          pool.async([&](void)
+                     {
+                       std::shared_ptr<AST> worker =
+                           CreateDeclsFromModule(vast_module, worker_options);
+                       if (!worker)
+                       {
+                         return;
+                       }
+
+                       const clang::PrintingPolicy policy =
+                           worker->ctx.getPrintingPolicy();
+                       for (size_t i = next_claim.fetch_add(1u); i < num_bodies;
+                            i = next_claim.fetch_add(1u))
+                       {
+                         PendingBody &pending = worker->body_queue[first + i];
+                         worker->LiftBody(pending);
+                         if (auto it = worker->printed_definitions.find(pending.decl);
+                             it != worker->printed_definitions.end())
+                         {
+                           definitions[i] = std::move(it->second);
+                           worker->printed_definitions.erase(it);
+                         }
+                         else if (pending.decl->doesThisDeclarationHaveABody())
+                         {
+                           std::string code;
+                           llvm::raw_string_ostream os(code);
+                           pending.decl->print(os, policy, /*Indentation=*/0u);
+                           os.flush();
+                           definitions[i] = std::move(code);
+                         }
+                         pending.lift = nullptr;
+                       } });
+        }
+        pool.wait();
+      }
+
+      // Every body claimed by a worker was lifted, and bodies are claimed in
+      // queue order.
+      const size_t num_lifted = std::min(next_claim.load(), num_bodies);
+      for (size_t i = 0u; i < num_lifted; ++i)
+      {
+        if (definitions[i])
+        {
+          printed_definitions.try_emplace(body_queue[first + i].decl,
+                                          std::move(definitions[i].value()));
+        }
+      }
+
+      if (num_lifted == num_bodies)
+      {
+        body_queue.clear();
+        next_body = 0u;
+      }
+      else
+      {
+        next_body = first + num_lifted;
+      }
+    }
+
+    void AST::ReportUnsupported(llvm::StringRef what, mlir::Operation &op)
+    {
+      if (HasDiagnosticHandler())
+      {
+        std::string message;
+        llvm::raw_string_ostream os(message);
+        os << "Can't lift " << what << ": " << op.getName();
+        Diagnose(os.str());
+      }
+    }
+
+    void AST::ReportUnsupported(llvm::StringRef what, mlir::Attribute attr)
+    {
+      if (HasDiagnosticHandler())
+      {
+        std::string message;
+        llvm::raw_string_ostream os(message);
+        os << "Can't lift " << what << ": " << attr;
+        Diagnose(os.str());
+      }
+    }
+
+    void AST::ReportUnsupported(llvm::StringRef what, mlir::Type type)
+    {
+      if (HasDiagnosticHandler())
+      {
+        std::string message;
+        llvm::raw_string_ostream os(message);
+        os << "Can't lift " << what << ": " << type;
+        Diagnose(os.str());
+      }
+    }
+
+    clang::Decl *AST::LiftDeclaration(mlir::Operation &op)
+    {
+      clang::TranslationUnitDecl *tu = ctx.getTranslationUnitDecl();
+      return llvm::TypeSwitch<mlir::Operation *, clang::Decl *>(&op)
+          .Case([&](vast::hl::FuncOp func_op)
+                { return LiftFuncOp(tu, tu, func_op); })
+          .Case([&](vast::hl::VarDeclOp var_op)
+                { return LiftVarDeclOp(tu, tu, var_op); })
+          .Case([&](vast::hl::TypeDefOp ty_def_op)
+                { return LiftTypeDefOp(tu, tu, ty_def_op); })
+          .Case([&](vast::hl::StructDeclOp strct_op)
+                { return LiftStructOp(tu, tu, strct_op); })
+          // .Case([&](vast::hl::EnumDeclOp enum_op) {})
+          // .Case([&](vast::hl::ClassDeclOp class_op) {})
+          .Default([&](mlir::Operation *) -> clang::Decl *
+                   { ReportUnsupported("declaration", op);
+                   return nullptr; });
+    }
+
+    clang::Decl *AST::LiftDependency(mlir::Operation &op)
+    {
+      (void)module_table.Insert(&op);
+      if (!mlir::isa<vast::hl::FuncOp>(op))
+      {
+        module_table.NumberNested(&op);
+      }
+
+      clang::Decl *decl = LiftDeclaration(op);
+      if (decl && !clang::isa<clang::FunctionDecl>(decl))
+      {
+        lifted_dependencies.push_back(decl);
+      }
+      return decl;
+    }
+
+    void AST::IndexFunctions(void)
+    {
+      // Only the top level of the module is indexed, and only once, so that
+      // the cost of every later lookup is independent of the module's size.
+      if (functions_indexed)
+      {
+        return;
+      }
+
+      mlir::ModuleOp module_op = vast_module->module.get();
+      for (mlir::Operation &op : module_op.getBody()->getOperations())
+      {
+        if (auto func = mlir::dyn_cast<vast::hl::FuncOp>(op))
+        {
+          (void)functions.try_emplace(np.FunctionName(func), func);
+        }
+      }
+      functions_indexed = true;
+    }
+
+    clang::FunctionDecl *AST::LiftFunction(llvm::StringRef name)
+    {
+      IndexFunctions();
+
+      // Fingerprint the declarations before any are lifted, and then each
+      // function as it's lifted, so that `Update` can tell what changed.
+      if (!fingerprint)
+      {
+        fingerprint = FingerprintDecls(vast_module->module.get());
+      }
+
+      auto it = functions.find(name);
+      if (it == functions.end())
+      {
+        return nullptr;
+      }
+
+      // Lifted by an earlier call, or as part of the whole module.
+      mlir::Operation *op = it->second.getOperation();
+      if (LiftTable::Entry *entry = module_table.Find(op); entry && entry->decl)
+      {
+        return clang::dyn_cast<clang::FunctionDecl>(entry->decl);
+      }
+
+      auto func_decl =
+          clang::dyn_cast_or_null<clang::FunctionDecl>(LiftDependency(*op));
+      LiftPending();
+      RecordFingerprints(it->second);
+      return func_decl;
+    }
+
+    void AST::LiftPending(void)
+    {
+      while (LiftNextBody())
+      {
+      }
+
+      // Lifting the bodies pulls in the globals that they reference, and
+      // lifting their initializers may pull in more.
+      DrainLiftQueue();
+      for (clang::Decl *decl : lifted_dependencies)
+      {
+        Parenthesize(decl);
+      }
+      lifted_dependencies.clear();
+    }
+
+    AST::ModuleFingerprint AST::FingerprintDecls(mlir::ModuleOp module_op)
+    {
+      ModuleFingerprint fp;
+      fp.decls.push_back(FingerprintAttributes(module_op.getOperation()));
+      for (mlir::Operation &op : module_op.getBody()->getOperations())
+      {
+        if (!mlir::isa<vast::hl::FuncOp>(op))
+        {
+          fp.decls.push_back(FunctionCache::Fingerprint(&op));
+          AppendKeys(&op, fp.decl_keys);
+        }
+      }
+      return fp;
+    }
+
+    std::optional<std::vector<uint64_t>> AST::FingerprintFunctions(
+        VASTModuleImpl &impl, llvm::ArrayRef<vast::hl::FuncOp> funcs)
+    {
+      for (vast::hl::FuncOp func : funcs)
+      {
+        if (!impl.Materialize(func.getOperation()))
+        {
+          return std::nullopt;
+        }
+      }
+
+      // Hashing a function prints it, so spread that across threads.
+      std::vector<uint64_t> hashes(funcs.size());
+      mlir::parallelFor(&(impl.context), 0u, funcs.size(), [&](size_t i)
+                        { hashes[i] = FunctionCache::Fingerprint(
+                              funcs[i].getOperation()); });
+      return hashes;
+    }
+
+    void AST::RecordFingerprints(llvm::ArrayRef<vast::hl::FuncOp> funcs)
+    {
+      if (!fingerprint)
+      {
+        return;
+      }
+
+      std::optional<std::vector<uint64_t>> hashes =
+          FingerprintFunctions(*vast_module, funcs);
+      if (!hashes)
+      {
+        fingerprint.reset();
+        return;
+      }
+
+      for (size_t i = 0u; i < funcs.size(); ++i)
+      {
+        fingerprint->functions[np.FunctionName(funcs[i])] = hashes->at(i);
+      }
+    }
+
+    bool AST::Update(std::shared_ptr<VASTModuleImpl> revision)
+    {
+      if (!fingerprint || function_names_ambiguous)
+      {
+        return false;
+      }
+
+      // Everything besides the functions must be the same, so that the other
+      // top-level operations line up one-to-one with those that were lifted,
+      // and whatever they were lifted into can be found through the
+      // revision's operations instead.
+      mlir::ModuleOp new_module_op = revision->module.get();
+      ModuleFingerprint new_fingerprint = FingerprintDecls(new_module_op);
+      if (fingerprint->decls != new_fingerprint.decls ||
+          fingerprint->decl_keys.size() != new_fingerprint.decl_keys.size())
+      {
+        return false;
+      }
+
+      // Functions are matched up by name, so a renamed function is one
+      // function removed, and another added.
+      llvm::StringSet<> names;
+      std::vector<vast::hl::FuncOp> kept;
+      std::vector<vast::hl::FuncOp> added;
+      for (mlir::Operation &op : new_module_op.getBody()->getOperations())
+      {
+        auto func = mlir::dyn_cast<vast::hl::FuncOp>(op);
+        if (!func)
+        {
+          continue;
+        }
+
+        std::string name = np.FunctionName(func);
+        if (!names.insert(name).second)
+        {
+          return false;
+        }
+        if (lifted_functions.count(name))
+        {
+          kept.push_back(func);
+        }
+        else if (whole_module)
+        {
+          added.push_back(func);
+        }
+      }
+
+      std::optional<std::vector<uint64_t>> hashes =
+          FingerprintFunctions(*revision, kept);
+      if (!hashes)
+      {
+        return false;
+      }
+
+      // Nothing can fail from here on.
+      LiftTable table;
+      for (size_t i = 0u; i < new_fingerprint.decl_keys.size(); ++i)
+      {
+        if (LiftTable::Entry *entry = module_table.Find(fingerprint->decl_keys[i]))
+        {
+          table.Insert(new_fingerprint.decl_keys[i]) = *entry;
+        }
+      }
+
+      std::vector<vast::hl::FuncOp> changed;
+      for (size_t i = 0u; i < kept.size(); ++i)
+      {
+        std::string name = np.FunctionName(kept[i]);
+        LiftedFunction &lifted = lifted_functions[name];
+        lifted.op = kept[i].getOperation();
+        table.Insert(lifted.op).decl = lifted.decl;
+        if (auto it = fingerprint->functions.find(name);
+            it == fingerprint->functions.end() || it->second != hashes->at(i))
+        {
+          changed.push_back(kept[i]);
+        }
+        new_fingerprint.functions[name] = hashes->at(i);
+      }
+
+      // Drop the functions that are gone.
+      clang::TranslationUnitDecl *tu = ctx.getTranslationUnitDecl();
+      std::vector<std::string> removed;
+      for (const auto &entry : lifted_functions)
+      {
+        if (!names.count(entry.first()))
+        {
+          clang::FunctionDecl *func_decl = entry.second.decl;
+          printed_definitions.erase(func_decl);
+          tu->removeDecl(func_decl);
+          removed.push_back(entry.first().str());
+        }
+      }
+      for (const std::string &name : removed)
+      {
+        lifted_functions.erase(name);
+      }
+
+      // The old module (which may be the revision itself) is kept alive until
+      // here, and its operations are forgotten along with `module_table`.
+      vast_module = std::move(revision);
+      module = std::shared_ptr<mlir::Operation>(
+          vast_module, vast_module->module->getOperation());
+      dl.emplace(mlir::dyn_cast<mlir::ModuleOp>(module.get()));
+      module_table = std::move(table);
+      functions.clear();
+      functions_indexed = false;
+      fingerprint = std::move(new_fingerprint);
+
+      // Types are uniqued by their MLIR context, and the revision may not
+      // share a context with the old module.
+      type_map.clear();
+
+      // New functions go after everything that's already in the translation
+      // unit.
+      for (vast::hl::FuncOp func : added)
+      {
+        (void)LiftDependency(*(func.getOperation()));
+      }
+      Relift(changed);
+      RecordFingerprints(added);
+      return true;
+    }
+
+    std::shared_ptr<AST> AST::CreateFromRevision(
+        std::shared_ptr<VASTModuleImpl> revision)
+    {
+      if (whole_module)
+      {
+        return CreateFromModule(std::move(revision), lift_options);
+      }
+
+      mlir::ModuleOp module_op = revision->module.get();
+      std::shared_ptr<AST> ast = CreateEmpty(std::move(revision), lift_options);
+      if (!ast)
+      {
+        return nullptr;
+      }
+
+      for (mlir::Operation &op : module_op.getBody()->getOperations())
+      {
+        auto func = mlir::dyn_cast<vast::hl::FuncOp>(op);
+        if (!func)
+        {
+          continue;
+        }
+        if (std::string name = np.FunctionName(func);
+            lifted_functions.count(name))
+        {
+          (void)ast->LiftFunction(name);
+        }
+      }
+      return ast;
+    }
+
+    void AST::Relift(llvm::ArrayRef<vast::hl::FuncOp> funcs)
+    {
+      std::vector<vast::hl::FuncOp> relifted;
+      for (vast::hl::FuncOp func : funcs)
+      {
+        auto it = lifted_functions.find(np.FunctionName(func));
+        if (it == lifted_functions.end())
+        {
+          continue;
+        }
+
+        // The function may have been replaced by a new operation, in which
+        // case forget what the old one was lifted into, lest its address be
+        // reused.
+        LiftedFunction &lifted = it->second;
+        mlir::Operation *op = func.getOperation();
+        if (lifted.op != op)
+        {
+          if (LiftTable::Entry *entry = module_table.Find(lifted.op))
+          {
+            *entry = {};
+          }
+          lifted.op = op;
+        }
+        module_table.Insert(op).decl = lifted.decl;
+
+        // Reuse the declaration, so that it keeps its place in the translation
+        // unit.
+        clang::FunctionDecl *func_decl = lifted.decl;
+        printed_definitions.erase(func_decl);
+        func_decl->setType(LiftType(func.getFunctionType()));
+        func_decl->setBody(nullptr);
+        DefineFuncOp(func, func_decl);
+        relifted.push_back(func);
+      }
+
+      LiftPending();
+      RecordFingerprints(relifted);
+    }
+
+    bool AST::Relift(llvm::ArrayRef<std::string> names)
+    {
+      // Edits made in place may have replaced functions, so index them again.
+      functions.clear();
+      functions_indexed = false;
+      IndexFunctions();
+
+      bool all_lifted = true;
+      std::vector<vast::hl::FuncOp> funcs;
+      for (const std::string &name : names)
+      {
+        auto it = functions.find(name);
+        if (it == functions.end() || !lifted_functions.count(name))
+        {
+          all_lifted = false;
+          continue;
+        }
+        funcs.push_back(it->second);
+      }
+
+      Relift(funcs);
+      return all_lifted;
+    }
+
+    void AST::DrainLiftQueue(void)
+    {
+      // Queued lifts (e.g. of initializers) happen after whatever statements
+      // they belong to have been made.
+      ++hoisting_blocked;
+      for (size_t i = 0; i < lift_queue.size(); i++)
+      {
+        lift_queue[i]();
+      }
+      lift_queue.clear();
+      --hoisting_blocked;
+    }
+
+    void AST::ForgetBody(void)
+    {
+      function_table.Clear();
+    }
+
+    LiftTable::Entry *AST::FindLifted(const void *key)
+    {
+      if (LiftTable::Entry *entry = function_table.Find(key))
+      {
+        return entry;
+      }
+      return module_table.Find(key);
+    }
+
+    LiftTable::Entry &AST::Lifted(mlir::Operation *op)
+    {
+      if (LiftTable::Entry *entry = function_table.Find(op))
+      {
+        return *entry;
+      }
+      return module_table.Insert(op);
+    }
+
     clang::Stmt *AST::LiftOp(clang::DeclContext *dc, mlir::Operation &op)
     {
-      if (auto it = op_to_stmt.find(&op); it != op_to_stmt.end())
+      HlOpKind kind = HlOpKind::kUnknown;
+      if (LiftTable::Entry *entry = FindLifted(&op); entry && entry->stmt)
+      {
+        return entry->stmt;
+      }
+      else if (entry && entry->classified)
+      {
+        kind = entry->kind;
+      }
+      else
       {
-        return it->second;
+        kind = KindOf(op);
       }
 
-      clang::Stmt *ret = LiftOpImpl(dc, op);
+      // `LiftOpImpl` reports what it couldn't lift.
+      clang::Stmt *ret = LiftOpImpl(dc, op, kind);
       if (!ret)
       {
-        op.dump();
-        assert(false);
         return nullptr;
       }
 
-      op_to_stmt.emplace(&op, ret);
-      return ret;
+      // Statements are only looked up again through uses of their results, so
+      // there's nothing to gain from remembering the rest.
+      if (op.use_empty())
+      {
+        return ret;
+      }
+
+      // `LiftExprOp` works out the depth of an `hl.expr` from what it yields.
+      unsigned depth = 0u;
+      if (kind == HlOpKind::kExprOp)
+      {
+        depth = Lifted(&op).depth;
+      }
+      else
+      {
+        depth = OperandDepth(op) + 1u;
+      }
+      return RecordLifted(dc, op, ret, depth);
     }
 
-    clang::Expr *AST::LiftValue(clang::DeclContext *dc, mlir::Value val)
+    unsigned AST::OperandDepth(mlir::Operation &op)
     {
-      if (mlir::Operation *op = val.getDefiningOp())
+      unsigned depth = 0u;
+      for (mlir::Value operand : op.getOperands())
       {
-        if (auto decl_it = op_to_decl.find(op); decl_it != op_to_decl.end())
+        if (LiftTable::Entry *entry = FindLifted(KeyOf(operand)))
         {
-          return CreateDeclRef(decl_it->second);
+          depth = std::max(depth, entry->depth);
         }
+      }
+      return depth;
+    }
+
+    clang::Stmt *AST::RecordLifted(clang::DeclContext *dc, mlir::Operation &op,
+                                   clang::Stmt *stmt, unsigned depth)
+    {
+      // Lifting `op` may have numbered more operations, so look up its entry
+      // again.
+      LiftTable::Entry &entry = Lifted(&op);
+      entry.stmt = stmt;
+      entry.depth = depth;
 
-        if (auto stmt_it = op_to_stmt.find(op); stmt_it != op_to_stmt.end())
+      // Only values that are used can be moved, and lvalues have to stay
+      // where they are for what's done to them to have effect.
+      const unsigned max_depth = lift_options.max_expression_depth;
+      auto expr = clang::dyn_cast<clang::Expr>(stmt);
+      if (!max_depth || depth <= max_depth || hoisting_blocked || !expr ||
+          op.use_empty() || !expr->isPRValue() ||
+          expr->getType()->isVoidType())
+      {
+        return stmt;
+      }
+
+      entry.stmt = MaterializeTemporary(dc, expr);
+      entry.depth = 1u;
+      return entry.stmt;
+    }
+
+    clang::Expr *AST::LiftValue(clang::DeclContext *dc, mlir::Value val)
+    {
+      const void *key = KeyOf(val);
+      LiftTable::Entry *entry = FindLifted(key);
+
+      // When lifting on demand, the first reference to a global declaration
+      // is what lifts it.
+      if (!entry || (!entry->decl && !entry->stmt))
+      {
+        if (mlir::Operation *op = val.getDefiningOp();
+            op && op->getParentOp() == module.get() && LiftDependency(*op))
         {
-          return clang::dyn_cast<clang::Expr>(stmt_it->second);
+          entry = FindLifted(key);
         }
       }
 
-      void *opaque = val.getAsOpaquePointer();
-      if (auto decl_it = val_to_decl.find(opaque); decl_it != val_to_decl.end())
+      if (entry)
       {
-        return CreateDeclRef(decl_it->second);
+        if (entry->decl)
+        {
+          return CreateDeclRef(entry->decl);
+        }
+        else if (entry->stmt)
+        {
+          return clang::dyn_cast<clang::Expr>(entry->stmt);
+        }
       }
 
-      // val.dump();
+      // Every value is defined by something lifted before its uses.
       assert(false);
-      std::cout << "OMG!\n";
       return nullptr;
     }
 
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "Clang.h"
+#include "FunctionCache.h"
 #include "VAST.h"
 #include "NameProvider.h"
 #include <iostream>
@@ -28,6 +29,9 @@
 #include <clang/Sema/Lookup.h>
 #include <clang/Sema/Sema.h>
 #include <llvm/ADT/APInt.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/TargetParser/Triple.h>
 #include <llvm/TargetParser/Host.h>
 #include <mlir/IR/Block.h>
@@ -41,9 +45,12 @@
 #pragma GCC diagnostic pop
 
 #include <cassert>
+#include <cstdint>
 #include <map>
+#include <memory>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <vector>
 #include <vast/Dialect/HighLevel/HighLevelOps.hpp>
 #include <vast/Dialect/Core/CoreOps.hpp>
 #include <vast/Dialect/HighLevel/HighLevelTypes.hpp>
@@ -55,18 +62,167 @@ namespace pillar
   namespace ast
   {
 
+    // A dense numbering of the operations and block arguments in some IR,
+    // along with what each was lifted into. Numbering everything up front lets
+    // the results of lifting live in one flat vector, with a single probe to
+    // find any of them.
+    class LiftTable
+    {
+    public:
+      struct Entry
+      {
+        clang::Stmt *stmt{nullptr};
+        clang::ValueDecl *decl{nullptr};
+
+        // The kind of operation, if this entry was numbered by
+        // `NumberNested`.
+        HlOpKind kind{HlOpKind::kUnknown};
+        bool classified{false};
+
+        // How deeply the operations making up `stmt` nest.
+        unsigned depth{0u};
+      };
+
+    private:
+      llvm::DenseMap<const void *, unsigned> index;
+      std::vector<Entry> entries;
+
+    public:
+      // Number every operation and block argument nested inside of `op`, and
+      // classify each operation. This only reads the IR, so tables for
+      // different functions can be numbered concurrently.
+      void NumberNested(mlir::Operation *op);
+
+      Entry *Find(const void *key);
+
+      // Returns the entry for `key`, numbering `key` if it isn't already.
+      Entry &Insert(const void *key);
+
+      void Clear(void);
+    };
+
     class AST final : public ClangModuleImpl
     {
     private:
       const bool char_is_unsigned;
-      const std::shared_ptr<mlir::Operation> module;
-      const mlir::DataLayout dl;
+
+      // The module being lifted. `Update` switches these to a revision of it.
+      std::shared_ptr<VASTModuleImpl> vast_module;
+      std::shared_ptr<mlir::Operation> module;
+      std::optional<mlir::DataLayout> dl;
+
       const NameProvider np;
+      const LiftOptions lift_options;
       std::vector<std::function<void(void)>> lift_queue;
 
-      std::unordered_map<mlir::Operation *, clang::Stmt *> op_to_stmt;
-      std::unordered_map<mlir::Operation *, clang::ValueDecl *> op_to_decl;
-      std::unordered_map<void *, clang::ValueDecl *> val_to_decl;
+      // What can be worked out about a function body from the IR alone,
+      // ahead of building its AST.
+      struct BodySummary
+      {
+        // The key of the function in the function cache, if there is one.
+        std::optional<uint64_t> cache_key;
+
+        // Everything in the body, numbered and classified.
+        LiftTable table;
+      };
+
+      // A function whose body has yet to be lifted.
+      struct PendingBody
+      {
+        vast::hl::FuncOp func;
+        clang::FunctionDecl *decl;
+        std::function<void(void)> lift;
+        std::unique_ptr<BodySummary> summary;
+      };
+
+      std::vector<PendingBody> body_queue;
+      size_t next_body{0u};
+
+      // Where to find and save the lifted C code of function bodies, if
+      // anywhere.
+      const std::unique_ptr<FunctionCache> function_cache;
+
+      // What the operations and block arguments at module level (including in
+      // global initializers) were lifted into, and likewise for the function
+      // whose body is being lifted.
+      LiftTable module_table;
+      LiftTable function_table;
+
+      // The functions in the module, by name, for lifting them on demand.
+      // Built by the first call to `LiftFunction`.
+      llvm::StringMap<vast::hl::FuncOp> functions;
+      bool functions_indexed{false};
+
+      // Globals and other non-function declarations lifted on demand, whose
+      // initializers have yet to be parenthesized.
+      std::vector<clang::Decl *> lifted_dependencies;
+
+      // Declarations of the temporaries made for the statement being lifted,
+      // to be placed before it.
+      std::vector<clang::Stmt *> hoisted;
+
+      // Non-zero while lifting something (e.g. a loop condition) that can't
+      // have statements placed before it.
+      unsigned hoisting_blocked{0u};
+
+      // Number of temporaries made in the function being lifted, for naming
+      // them.
+      unsigned num_temporaries{0u};
+
+      // Whether every declaration in the module was lifted, rather than only
+      // what `LiftFunction` asked for.
+      bool whole_module{false};
+
+      // Hashes of what was lifted from a module, taken as it was lifted, for
+      // working out what a later revision of it changed. The revision may be
+      // the same module, edited in place.
+      struct ModuleFingerprint
+      {
+        // The module's attributes (e.g. its target triple and data layout),
+        // followed by every top-level operation other than a function, in
+        // order.
+        std::vector<uint64_t> decls;
+
+        // The keys of the top-level operations other than functions, and of
+        // everything nested in them, in the order of `AppendKeys`. These may
+        // have been erased since, so they're only ever looked up.
+        std::vector<const void *> decl_keys;
+
+        // Every function that was lifted, by name.
+        llvm::StringMap<uint64_t> functions;
+      };
+
+      // Taken when declarations are first lifted from `vast_module`, and kept
+      // up to date as functions are lifted.
+      std::optional<ModuleFingerprint> fingerprint;
+
+      // A function that was lifted. `op` may have been erased since, so it's
+      // only ever compared against.
+      struct LiftedFunction
+      {
+        mlir::Operation *op;
+        clang::FunctionDecl *decl;
+      };
+
+      // The functions that were lifted, by name. Functions are matched up
+      // with their revisions by name, so this only works if no two lifted
+      // functions share a name.
+      llvm::StringMap<LiftedFunction> lifted_functions;
+      bool function_names_ambiguous{false};
+
+      static ModuleFingerprint FingerprintDecls(mlir::ModuleOp module_op);
+
+      // Hash each of `funcs`, reading in their bodies first if need be.
+      // Returns `std::nullopt` if a body couldn't be read.
+      static std::optional<std::vector<uint64_t>> FingerprintFunctions(
+          VASTModuleImpl &impl, llvm::ArrayRef<vast::hl::FuncOp> funcs);
+
+      // Add `funcs`, which were just lifted, to `fingerprint`.
+      void RecordFingerprints(llvm::ArrayRef<vast::hl::FuncOp> funcs);
+
+      // Index the functions in the module by name, if that hasn't been done.
+      void IndexFunctions(void);
+
       // MLIR types are uniqued, so we can cache any type liftings that we've
       // performed.
       llvm::DenseMap<mlir::Type, clang::QualType> type_map;
@@ -101,20 +257,137 @@ namespace pillar
       // lifted expression.
       static bool ElideFromCompoundStmt(mlir::Operation &op, clang::Stmt *stmt);
 
+      void DrainLiftQueue(void);
+
+      // Lift the top-level operation `op` into a declaration in the
+      // translation unit, queueing up the bodies of functions.
+      clang::Decl *LiftDeclaration(mlir::Operation &op);
+
+      // Number and lift the top-level operation `op`, which wasn't lifted
+      // along with the rest of the module.
+      clang::Decl *LiftDependency(mlir::Operation &op);
+
+      // Lift every queued body, and then the initializers of the globals that
+      // they pulled in.
+      void LiftPending(void);
+
+      // Lift and parenthesize the body of `pending`, unless it's in the
+      // function cache.
+      void LiftBody(PendingBody &pending);
+
+      // Summarize every remaining body, using the MLIR context's threads. This
+      // front-loads the part of lifting that doesn't touch Clang.
+      void AnalyzeBodies(void);
+
+      // Lift the remaining bodies on up to `num_threads` threads, each with
+      // its own AST holding the module's declarations, and keep the printed
+      // definitions.
+      void LiftBodiesInParallel(unsigned num_threads);
+
+      // Drop the lifting state that's local to the function whose body was
+      // just lifted. Nothing outside of a function refers into its body, so
+      // this keeps the tables bounded by the largest function.
+      void ForgetBody(void);
+
+      // Returns what `key` (an operation, or the opaque pointer of a block
+      // argument) was lifted into, looking in the current function first.
+      LiftTable::Entry *FindLifted(const void *key);
+
+      // Returns the entry for what `op` is lifted into.
+      LiftTable::Entry &Lifted(mlir::Operation *op);
+
+      // How deeply the lifted operands of `op` nest.
+      unsigned OperandDepth(mlir::Operation &op);
+
+      // Record that `op` was lifted into `stmt`, which nests `depth` deep,
+      // moving `stmt` into a temporary if it's too deep. Returns what uses of
+      // `op` should use.
+      clang::Stmt *RecordLifted(clang::DeclContext *dc, mlir::Operation &op,
+                                clang::Stmt *stmt, unsigned depth);
+
+      // Declare a temporary in `dc` initialized with `expr`, and return a use
+      // of it.
+      clang::Expr *MaterializeTemporary(clang::DeclContext *dc,
+                                        clang::Expr *expr);
+
+      // Report, through the diagnostic handler, that `op`, `attr`, or `type`
+      // couldn't be lifted as `what`. The caller fails as it would otherwise.
+      void ReportUnsupported(llvm::StringRef what, mlir::Operation &op);
+      void ReportUnsupported(llvm::StringRef what, mlir::Attribute attr);
+      void ReportUnsupported(llvm::StringRef what, mlir::Type type);
+
     public:
-      explicit AST(const llvm::Triple &triple, std::shared_ptr<mlir::Operation> op);
+      explicit AST(const llvm::Triple &triple, std::unique_ptr<ClangUnit> unit,
+                   std::shared_ptr<VASTModuleImpl> vast_module,
+                   const LiftOptions &options);
 
       void AddToLiftQueue(std::function<void(void)> lift);
       void LiftIf(bool condition, std::function<void(void)> lift);
 
+      // An AST for `vast_module` into which nothing has been lifted yet. Use
+      // `LiftFunction` to lift parts of the module into it. Returns `nullptr`
+      // if Clang can't be set up for the module's target triple, as do the
+      // other `Create*` functions.
+      static std::shared_ptr<AST> CreateEmpty(
+          std::shared_ptr<VASTModuleImpl> vast_module,
+          const LiftOptions &options);
+
       static std::shared_ptr<AST> CreateFromModule(
-          std::shared_ptr<mlir::Operation> op);
+          std::shared_ptr<VASTModuleImpl> vast_module,
+          const LiftOptions &options);
+
+      // Lift the declarations in the module, and the initializers of global
+      // variables, but not function bodies; those are lifted one at a time by
+      // `LiftNextBody`.
+      static std::shared_ptr<AST> CreateDeclsFromModule(
+          std::shared_ptr<VASTModuleImpl> vast_module,
+          const LiftOptions &options);
+
+      // Lift and parenthesize the body of the next function, in declaration
+      // order. Returns the function, which may turn out to have no body, or
+      // `nullptr` once every function has been visited.
+      clang::FunctionDecl *LiftNextBody(void);
+
+      // Bring the AST up to date with `revision`, a later version of the
+      // module. This only works when the revision adds, removes, or changes
+      // functions, and leaves everything else at the top level alone; only
+      // the functions that were added or changed are lifted, and the rest of
+      // the AST is kept. Returns `false`, without changing anything, if the
+      // revision changes more than that.
+      bool Update(std::shared_ptr<VASTModuleImpl> revision);
+
+      // Lift the same parts of `revision` into a new AST as were lifted from
+      // the module into this one. Returns `nullptr` on failure.
+      std::shared_ptr<AST> CreateFromRevision(
+          std::shared_ptr<VASTModuleImpl> revision);
+
+      // Lift the bodies and signatures of `funcs` again, e.g. after they were
+      // edited in place. Functions that were never lifted are skipped.
+      void Relift(llvm::ArrayRef<vast::hl::FuncOp> funcs);
+
+      // Lift the functions named `names` again, after they were edited in
+      // place. Returns `false` if any of them isn't a function that was
+      // lifted; the others are still lifted again.
+      bool Relift(llvm::ArrayRef<std::string> names);
+
+      // Lift the function named `name`, along with the global declarations
+      // that it transitively references, unless it was lifted already.
+      // Returns the function, or `nullptr` if there is no such function.
+      clang::FunctionDecl *LiftFunction(llvm::StringRef name);
 
       clang::QualType LiftType(mlir::Type ty);
       clang::QualType LiftFunctionType(vast::core::FunctionType ty);
+
+      // The lifted type of the result of `op`, or a null type if `op` doesn't
+      // have exactly one result.
+      clang::QualType ResultType(mlir::Operation &op);
       clang::FunctionDecl *LiftFuncOp(clang::DeclContext *sdc,
                                       clang::DeclContext *ldc,
                                       vast::hl::FuncOp func);
+
+      // Give `func_decl` the parameters of `func`, and queue up the lifting of
+      // its body, if it has one.
+      void DefineFuncOp(vast::hl::FuncOp func, clang::FunctionDecl *func_decl);
       clang::VarDecl *LiftVarDeclOp(clang::DeclContext *sdc,
                                     clang::DeclContext *ldc,
                                     vast::hl::VarDeclOp var_decl_op);
@@ -134,7 +407,8 @@ namespace pillar
       clang::CompoundStmt *LiftRegion(clang::DeclContext *dc,
                                       mlir::Region &region);
       clang::Stmt *LiftOp(clang::DeclContext *dc, mlir::Operation &op);
-      clang::Stmt *LiftOpImpl(clang::DeclContext *dc, mlir::Operation &op);
+      clang::Stmt *LiftOpImpl(clang::DeclContext *dc, mlir::Operation &op,
+                              HlOpKind kind);
       clang::Expr *LiftCondition(clang::DeclContext *dc, mlir::Region &region);
       clang::DoStmt *LiftDoOp(clang::DeclContext *dc, mlir::Operation &op);
       clang::DeclStmt *LiftVarDeclOp(clang::DeclContext *dc, mlir::Operation &op_);
@@ -11,7 +11,6 @@ namespace pillar
 {
   namespace ast
   {
-    static constexpr clang::SourceLocation kEmptyLoc;
     clang::FunctionDecl *AST::LiftFuncOp(clang::DeclContext *sdc,
                                          clang::DeclContext *ldc,
                                          vast::hl::FuncOp func)
@@ -23,72 +22,76 @@ namespace pillar
       llvm::StringRef function_name_str_ref(function_name.c_str(), function_name.length());
       clang::FunctionDecl *func_decl = CreateFunctionDecl(
           sdc, ldc, fty, function_name_str_ref);
-      llvm::SmallVector<clang::ParmVarDecl *, 6u> args;
 
       sdc->addDecl(func_decl);
 
       // Base case; make sure we can always find this function.
-      mlir::Operation *op = reinterpret_cast<mlir::Operation *>(
-          const_cast<void *>(func.getAsOpaquePointer()));
-      op_to_decl.emplace(
-          op,
-          func_decl);
-
-      // Lift the arguments.
-      unsigned arg_i = 0u;
-      for (mlir::BlockArgument arg : func.getArguments())
+      Lifted(func.getOperation()).decl = func_decl;
+      if (!lifted_functions
+               .try_emplace(function_name,
+                            LiftedFunction{func.getOperation(), func_decl})
+               .second)
+      {
+        function_names_ambiguous = true;
+      }
+
+      DefineFuncOp(func, func_decl);
+      return func_decl;
+    }
+
+    void AST::DefineFuncOp(vast::hl::FuncOp func,
+                           clang::FunctionDecl *func_decl)
+    {
+      mlir::Operation *op = func.getOperation();
+      llvm::SmallVector<clang::ParmVarDecl *, 6u> args;
+
+      // Lift the arguments. These come from the function's type, because the
+      // body (and so the entry block's arguments) may not have been read yet.
+      // `LiftNextBody` exposes the entry block's arguments as these.
+      vast::core::FunctionType func_type = func.getFunctionType();
+      for (unsigned arg_i = 0u, num_args = func_type.getNumInputs();
+           arg_i < num_args; ++arg_i)
       {
 
         // TODO(pag): Figure out how to get this from VAST.
-        std::string arg_name_str = np.FunctionParameterName(func, arg_i++);
+        std::string arg_name_str = np.FunctionParameterName(func, arg_i);
         clang::IdentifierInfo *arg_name =
             CreateIdentifier(arg_name_str);
-        clang::QualType arg_ty = LiftType(arg.getType());
+        clang::QualType arg_ty = LiftType(func_type.getInput(arg_i));
         clang::ParmVarDecl *arg_decl = sema.CheckParameter(
             func_decl, clang::SourceLocation(), clang::SourceLocation{},
             arg_name, arg_ty, ctx.getTrivialTypeSourceInfo(arg_ty),
             clang::SC_None);
         args.push_back(arg_decl);
-
-        // Expose the argument value.
-        val_to_decl.emplace(arg.getAsOpaquePointer(), arg_decl);
       }
       func_decl->setParams(args);
 
       // TODO(pag): Linkage.
 
+      // If the module was read lazily, then the body won't be there until we
+      // materialize it, which `LiftNextBody` defers until the body is actually
+      // lifted.
       mlir::Region &body = func.getBody();
-      if (!body.hasOneBlock())
+      const bool materializable = vast_module->IsMaterializable(op);
+      if (!materializable && !body.hasOneBlock())
       {
         assert(body.getBlocks().empty());
-        return func_decl;
+        return;
       }
       auto lift_body = [=, &body, this](void)
       {
-        // Lift each statement from the function body, collecting them into
-        // `body_stmts`.
-        std::vector<clang::Stmt *> body_stmts;
-        for (mlir::Operation &op : body.front())
+        // It was only a declaration after all.
+        if (!body.hasOneBlock())
         {
-
-          if (clang::Stmt *stmt = LiftOp(func_decl, op))
-          {
-            if (!ElideFromCompoundStmt(op, stmt))
-            {
-              body_stmts.emplace_back(stmt);
-            }
-          }
+          assert(body.getBlocks().empty());
+          return;
         }
 
-        clang::FPOptionsOverride fpo;
-        clang::CompoundStmt *body_stmt = clang::CompoundStmt::Create(
-            ctx, body_stmts, fpo, kEmptyLoc, kEmptyLoc);
-        func_decl->setBody(body_stmt);
+        // Lift each statement from the function body.
+        func_decl->setBody(LiftRegion(func_decl, body));
       };
 
-      AST::AddToLiftQueue(std::move(lift_body));
-
-      return func_decl;
+      body_queue.push_back({func, func_decl, std::move(lift_body)});
     }
     clang::VarDecl *AST::LiftVarDeclOp(clang::DeclContext *sdc,
                                        clang::DeclContext *ldc,
@@ -101,19 +104,30 @@ namespace pillar
       clang::QualType clang_type = LiftType(varType);
       clang::VarDecl *var_decl = CreateVarDeclFromStrRef(sdc, ldc, clang_type, name);
       sdc->addDecl(var_decl);
-      op_to_decl.emplace(
-          var_decl_op,
-          var_decl);
+      Lifted(var_decl_op).decl = var_decl;
       if (mlir::Region *init = &(var_decl_op.getInitializer()))
       {
+        auto lift_init = [=, this](void)
+        {
+          for (mlir::Block &block : init->getBlocks())
+          {
+            var_decl->setInit(LiftBlockExpr(sdc, block));
+            break;
+          }
+        };
 
-        AddToLiftQueue([=, this]()
-                       {
-      for (mlir::Block &block : init->getBlocks())
-      {
-        var_decl->setInit(LiftBlockExpr(sdc, block));
-        break;
-      } });
+        // A local's initializer is lifted along with its declaration, so that
+        // any temporaries it needs are declared just before it, and evaluated
+        // at the same point. Those of globals wait until every declaration
+        // has been lifted.
+        if (sdc->isFileContext())
+        {
+          AddToLiftQueue(std::move(lift_init));
+        }
+        else
+        {
+          lift_init();
+        }
       }
 
       return var_decl;
@@ -150,9 +164,6 @@ namespace pillar
 
       sdc->addDecl(record_decl);
       record_decl->completeDefinition();
-      op_to_decl.emplace(
-          strct_op,
-          clang::dyn_cast<ValueDecl>(record_decl));
 
       return record_decl;
     }
@@ -164,7 +175,7 @@ namespace pillar
           .Case([&](vast::hl::FieldDeclOp field_op)
                 { return LiftFieldDeclOp(record_decl, record_decl, record_decl, field_op); })
           .Default([&](mlir::Operation *)
-                   { std::cout << "No handler Tag: " << op_.getName().getStringRef().str() << "\n";
+                   { ReportUnsupported("record member", op_);
                    return nullptr; });
 
       return nullptr;
@@ -173,7 +184,7 @@ namespace pillar
                                            clang::DeclContext *ldc,
                                            vast::hl::TypeDefOp type_def_op)
     {
-      std::cout << "TypeDef Lifted\n";
+      // TODO: Type definitions aren't lifted yet.
       return nullptr;
     }
   } // namespace ast
@@ -47,6 +47,15 @@ namespace pillar
 
     } // namespace
 
+    clang::QualType AST::ResultType(mlir::Operation &op)
+    {
+      if (op.getNumResults() != 1u)
+      {
+        return {};
+      }
+      return LiftType(op.getResult(0u).getType());
+    }
+
     clang::Expr *AST::LiftAddIOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
       vast::hl::AddIOp op = mlir::dyn_cast<vast::hl::AddIOp>(op_);
@@ -54,7 +63,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateAdd(lhs_expr, rhs_expr);
+      return CreateAdd(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftSubIOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -64,7 +73,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateSub(lhs_expr, rhs_expr);
+      return CreateSub(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftMulIOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -74,7 +83,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateMul(lhs_expr, rhs_expr);
+      return CreateMul(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftDivSOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -84,7 +93,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateDiv(lhs_expr, rhs_expr);
+      return CreateDiv(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftDivUOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -94,7 +103,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateDiv(lhs_expr, rhs_expr);
+      return CreateDiv(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftRemSOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -104,7 +113,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateRem(lhs_expr, rhs_expr);
+      return CreateRem(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftRemUOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -114,7 +123,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateRem(lhs_expr, rhs_expr);
+      return CreateRem(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftAShrOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -124,7 +133,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateShr(lhs_expr, rhs_expr);
+      return CreateShr(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftLShrOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -134,7 +143,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateShr(lhs_expr, rhs_expr);
+      return CreateShr(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftShlOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -144,7 +153,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateShl(lhs_expr, rhs_expr);
+      return CreateShl(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftBinAndOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -154,7 +163,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateAnd(lhs_expr, rhs_expr);
+      return CreateAnd(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftBinOrOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -164,7 +173,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateOr(lhs_expr, rhs_expr);
+      return CreateOr(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     clang::Expr *AST::LiftBinXorOp(clang::DeclContext *dc, mlir::Operation &op_)
@@ -174,7 +183,7 @@ namespace pillar
       clang::Expr *rhs_expr = LiftValue(dc, op.getRhs());
       assert(lhs_expr != nullptr);
       assert(rhs_expr != nullptr);
-      return CreateXor(lhs_expr, rhs_expr);
+      return CreateXor(lhs_expr, rhs_expr, ResultType(op_));
     }
 
     // Lift a bitwise negation, e.g. `operator~` in C.
@@ -185,7 +194,7 @@ namespace pillar
       vast::hl::NotOp op = mlir::dyn_cast<vast::hl::NotOp>(op_);
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateNot(sub_expr);
+      return CreateNot(sub_expr, ResultType(op_));
     }
 
     // Lift a logical negation, e.g. `operator!` in C.
@@ -196,7 +205,7 @@ namespace pillar
       vast::hl::LNotOp op = mlir::dyn_cast<vast::hl::LNotOp>(op_);
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateLNot(sub_expr);
+      return CreateLNot(sub_expr, ResultType(op_));
     }
 
     // Lift a reference to a prior declaration. E.g.
@@ -216,40 +225,114 @@ namespace pillar
     //        ...
     //        hl.value.yield %15 : !hl.int< unsigned >
     //      }
+    //
+    // `hl.expr`s nest as deeply as the expressions that they came from, so the
+    // nested ones are lifted using an explicit stack, rather than by recursing
+    // through `LiftOp`.
     clang::Expr *AST::LiftExprOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
-      vast::hl::ExprOp op = mlir::dyn_cast<vast::hl::ExprOp>(op_);
-      clang::Expr *result_expr = nullptr;
-      for (mlir::Operation &sub_op : op.getSubexpr().getOps())
+      struct Frame
+      {
+        mlir::Operation *op;
+        mlir::Region::OpIterator next;
+        mlir::Region::OpIterator end;
+        clang::Expr *result{nullptr};
+        unsigned depth{0u};
+      };
+
+      auto enter = [](mlir::Operation &op) -> Frame
+      {
+        auto sub_ops = mlir::cast<vast::hl::ExprOp>(op).getSubexpr().getOps();
+        return {&op, sub_ops.begin(), sub_ops.end()};
+      };
+
+      std::vector<Frame> stack;
+      stack.push_back(enter(op_));
+      for (;;)
       {
+        Frame &frame = stack.back();
+        if (frame.next == frame.end)
+        {
+          assert(frame.result != nullptr);
+          const Frame done = frame;
+          stack.pop_back();
+
+          // `LiftOp` records the outermost one.
+          if (stack.empty())
+          {
+            if (!done.op->use_empty())
+            {
+              Lifted(done.op).depth = done.depth;
+            }
+            return done.result;
+          }
+          if (!done.op->use_empty())
+          {
+            (void)RecordLifted(dc, *(done.op), done.result, done.depth);
+          }
+          continue;
+        }
+
+        mlir::Operation &sub_op = *(frame.next++);
+        if (mlir::isa<vast::hl::ExprOp>(sub_op))
+        {
+          if (LiftTable::Entry *entry = FindLifted(&sub_op); !entry || !entry->stmt)
+          {
+            stack.push_back(enter(sub_op));
+            continue;
+          }
+        }
+
         if (clang::Stmt *sub_expr = LiftOp(dc, sub_op))
         {
           if (mlir::isa<vast::hl::ValueYieldOp>(sub_op))
           {
-            assert(!result_expr);
-            result_expr = clang::dyn_cast<clang::Expr>(sub_expr);
+            assert(!frame.result);
+            frame.result = clang::dyn_cast<clang::Expr>(sub_expr);
+            frame.depth = OperandDepth(sub_op) + 1u;
           }
         }
       }
-      assert(result_expr != nullptr);
-      return result_expr;
     }
+
+    // Temporaries made while lifting a statement are declared just before it.
     clang::CompoundStmt *AST::LiftRegion(clang::DeclContext *dc, mlir::Region &region)
     {
+      std::vector<clang::Stmt *> outer_hoisted;
+      outer_hoisted.swap(hoisted);
+
       std::vector<clang::Stmt *> body_stmts;
       for (mlir::Operation &body_op : region.getOps())
       {
-        if (clang::Stmt *body_stmt = LiftOp(dc, body_op))
+        clang::Stmt *body_stmt = LiftOp(dc, body_op);
+        body_stmts.insert(body_stmts.end(), hoisted.begin(), hoisted.end());
+        hoisted.clear();
+        if (body_stmt && !ElideFromCompoundStmt(body_op, body_stmt))
         {
-          if (!ElideFromCompoundStmt(body_op, body_stmt))
-          {
-            body_stmts.push_back(body_stmt);
-          }
+          body_stmts.push_back(body_stmt);
         }
       }
 
+      hoisted.swap(outer_hoisted);
       return CreateCompoundStmt(body_stmts);
     }
+
+    clang::Expr *AST::MaterializeTemporary(clang::DeclContext *dc,
+                                           clang::Expr *expr)
+    {
+      std::string name = "__pillar_tmp_" + std::to_string(num_temporaries++);
+      clang::VarDecl *tmp =
+          CreateVarDeclFromStrRef(dc, dc, expr->getType(), name);
+      dc->addDecl(tmp);
+      tmp->setInit(expr);
+      hoisted.push_back(new (ctx) clang::DeclStmt(clang::DeclGroupRef(tmp),
+                                                  kEmptyLoc, kEmptyLoc));
+
+      clang::Expr *ref = CreateDeclRef(tmp);
+      return clang::ImplicitCastExpr::Create(
+          ctx, expr->getType(), clang::CK_LValueToRValue, ref,
+          /* BasePath= */ nullptr, clang::VK_PRValue, kEmptyFPO);
+    }
     clang::Expr *AST::LiftBlockExpr(clang::DeclContext *dc, mlir::Block &block)
     {
       clang::Expr *result_expr = nullptr;
@@ -283,9 +366,7 @@ namespace pillar
           .Case<vast::core::BooleanAttr>(
               [=, this](vast::core::BooleanAttr v) -> clang::Expr *
               {
-                (void)this;
-                v.dump();
-                assert(false);
+                ReportUnsupported("constant", v);
                 return nullptr;
               })
           .Case<vast::core::IntegerAttr>(
@@ -296,7 +377,7 @@ namespace pillar
                 llvm::APSInt v_val = v.getValue();
                 llvm::ArrayRef<uint64_t> data(v_val.getRawData(),
                                               v_val.getNumWords());
-                llvm::APInt val(dl.getTypeSizeInBits(v_type), data);
+                llvm::APInt val(dl->getTypeSizeInBits(v_type), data);
                 return clang::IntegerLiteral::Create(
                     ctx, val, LiftType(v_type), kEmptyLoc);
               })
@@ -319,9 +400,7 @@ namespace pillar
           .Default(
               [=, this](mlir::TypedAttr v) -> clang::Expr *
               {
-                (void)this;
-                v.dump();
-                assert(false);
+                ReportUnsupported("constant", v);
                 return nullptr;
               });
     }
@@ -436,23 +515,13 @@ namespace pillar
       vast::hl::DoOp op = mlir::dyn_cast<vast::hl::DoOp>(op_);
 
       // Lift each statement in the body of this `do`.
-      llvm::SmallVector<clang::Stmt *, 8> body_stmts;
-      for (mlir::Operation &body_op : op.getBodyRegion().getOps())
-      {
-        if (clang::Stmt *body_stmt = LiftOp(dc, body_op))
-        {
-          if (!ElideFromCompoundStmt(body_op, body_stmt))
-          {
-            body_stmts.push_back(body_stmt);
-          }
-        }
-      }
-
-      clang::CompoundStmt *body = clang::CompoundStmt::Create(
-          ctx, body_stmts, kEmptyFPO, kEmptyLoc, kEmptyLoc);
+      clang::CompoundStmt *body = LiftRegion(dc, op.getBodyRegion());
 
-      // Lift each statement in the condition.
+      // Lift each statement in the condition, which is evaluated on every
+      // iteration, and so can't use temporaries made before the loop.
+      ++hoisting_blocked;
       clang::Expr *cond_expr = LiftCondition(dc, op.getCondRegion());
+      --hoisting_blocked;
 
       return CreateDo(cond_expr, body);
     }
@@ -488,7 +557,7 @@ namespace pillar
 
       assert(dst_expr != nullptr);
       assert(src_expr != nullptr);
-      return CreateAssign(dst_expr, src_expr);
+      return CreateAssign(dst_expr, src_expr, ResultType(op_));
     }
     clang::IfStmt *AST::LiftIfOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
@@ -508,7 +577,9 @@ namespace pillar
     clang::WhileStmt *AST::LiftWhileOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
       vast::hl::WhileOp op = mlir::dyn_cast<vast::hl::WhileOp>(op_);
+      ++hoisting_blocked;
       clang::Expr *cond_expr = LiftCondition(dc, op.getCondRegion());
+      --hoisting_blocked;
       clang::CompoundStmt *body = LiftRegion(dc, op.getBodyRegion());
 
       return CreateWhile(cond_expr, body);
@@ -527,21 +598,21 @@ namespace pillar
       switch (op.getPredicate())
       {
       case vast::hl::Predicate::eq:
-        return CreateEQ(lhs_expr, rhs_expr);
+        return CreateEQ(lhs_expr, rhs_expr, ResultType(op_));
       case vast::hl::Predicate::ne:
-        return CreateNE(lhs_expr, rhs_expr);
+        return CreateNE(lhs_expr, rhs_expr, ResultType(op_));
       case vast::hl::Predicate::slt:
       case vast::hl::Predicate::ult:
-        return CreateLT(lhs_expr, rhs_expr);
+        return CreateLT(lhs_expr, rhs_expr, ResultType(op_));
       case vast::hl::Predicate::sgt:
       case vast::hl::Predicate::ugt:
-        return CreateGT(lhs_expr, rhs_expr);
+        return CreateGT(lhs_expr, rhs_expr, ResultType(op_));
       case vast::hl::Predicate::sle:
       case vast::hl::Predicate::ule:
-        return CreateLE(lhs_expr, rhs_expr);
+        return CreateLE(lhs_expr, rhs_expr, ResultType(op_));
       case vast::hl::Predicate::sge:
       case vast::hl::Predicate::uge:
-        return CreateGE(lhs_expr, rhs_expr);
+        return CreateGE(lhs_expr, rhs_expr, ResultType(op_));
       default:
         throw std::invalid_argument("Unsupported comparison operation");
       }
@@ -551,6 +622,7 @@ namespace pillar
     {
 
       vast::hl::ForOp op = mlir::dyn_cast<vast::hl::ForOp>(op_);
+      ++hoisting_blocked;
       clang::Expr *cond_expr = LiftCondition(dc, op.getCondRegion());
 
       clang::Expr *inc = nullptr;
@@ -559,6 +631,7 @@ namespace pillar
 
         inc = LiftBlockExpr(dc, block);
       }
+      --hoisting_blocked;
       clang::CompoundStmt *body = LiftRegion(dc, op.getBodyRegion());
 
       return CreateFor(nullptr, cond_expr, inc, body);
@@ -569,7 +642,7 @@ namespace pillar
 
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateUnaryOp(clang::UO_PostInc, sub_expr);
+      return CreateUnaryOp(clang::UO_PostInc, sub_expr, ResultType(op_));
     }
     clang::UnaryOperator *AST::LiftPostDecOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
@@ -577,7 +650,7 @@ namespace pillar
 
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateUnaryOp(clang::UO_PostDec, sub_expr);
+      return CreateUnaryOp(clang::UO_PostDec, sub_expr, ResultType(op_));
     }
     clang::UnaryOperator *AST::LiftPreIncOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
@@ -585,7 +658,7 @@ namespace pillar
 
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateUnaryOp(clang::UO_PreInc, sub_expr);
+      return CreateUnaryOp(clang::UO_PreInc, sub_expr, ResultType(op_));
     }
     clang::UnaryOperator *AST::LiftPreDecOp(clang::DeclContext *dc, mlir::Operation &op_)
     {
@@ -593,13 +666,14 @@ namespace pillar
 
       clang::Expr *sub_expr = LiftValue(dc, op.getArg());
       assert(sub_expr != nullptr);
-      return CreateUnaryOp(clang::UO_PreDec, sub_expr);
+      return CreateUnaryOp(clang::UO_PreDec, sub_expr, ResultType(op_));
     }
 
     // TODO(bmt): add more cases
-    clang::Stmt *AST::LiftOpImpl(clang::DeclContext *dc, mlir::Operation &op)
+    clang::Stmt *AST::LiftOpImpl(clang::DeclContext *dc, mlir::Operation &op,
+                                 HlOpKind kind)
     {
-      switch (KindOf(op))
+      switch (kind)
       {
       case HlOpKind::kUnknown:
         // clang::Stmt *ret;
@@ -607,7 +681,7 @@ namespace pillar
             .Case([&](vast::core::ScopeOp scope)
                   { return LiftScopeOp(dc, op); })
             .Default([&](mlir::Operation *)
-                     { std::cout << "No handler for this unknown op!" << endl; 
+                     { ReportUnsupported("operation", op);
                      return nullptr; });
       case HlOpKind::kBinShlOp:
         return LiftShlOp(dc, op);
@@ -680,8 +754,7 @@ namespace pillar
       case HlOpKind::kCmpOp:
         return LiftCmpOp(dc, op);
       default:
-        std::cout << "No Lifter found for op!\n";
-        op.dump();
+        ReportUnsupported("operation", op);
         return nullptr;
       }
     }
@@ -201,9 +201,7 @@ namespace pillar
                                        { return LiftFunctionType(fty); })
                                  .Default([=, this](auto t) -> clang::QualType
                                           {
-                                            (void) this;
-          t.dump();
-          assert(false);
+          ReportUnsupported("type", t);
           return {}; }))
           .first->second;
 
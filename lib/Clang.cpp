@@ -5,8 +5,14 @@
 // the LICENSE file found in the root directory of this source tree.
 
 #include "Clang.h"
+#include "ClangFactory.h"
+#include "FunctionCache.h"
+#include "Index.h"
+#include "Printer.h"
 
 #include <cassert>
+#include <mutex>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -15,7 +21,16 @@
 #pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
 #pragma GCC diagnostic ignored "-Wsign-conversion"
 #pragma GCC diagnostic ignored "-Wshorten-64-to-32"
-#include <clang/Tooling/Tooling.h>
+#include <clang/AST/ASTDumperUtils.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/Expr.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Sema/DeclSpec.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Serialization/ASTWriter.h>
+#include <clang/Serialization/InMemoryModuleCache.h>
+#include <clang/Serialization/PCHContainerOperations.h>
 // #include <clang/AST/ASTConsumer.h>
 // #include <clang/Basic/Builtins.h>
 // #include <clang/Basic/Diagnostic.h>
@@ -29,6 +44,9 @@
 // #include <clang/Lex/Preprocessor.h>
 // #include <clang/Lex/PreprocessorOptions.h>
 // #include <clang/Sema/Lookup.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/TargetParser/Host.h>
 #include <llvm/TargetParser/Triple.h>
 #include <llvm/Support/CrashRecoveryContext.h>
 #include <llvm/Support/DynamicLibrary.h>
@@ -37,6 +55,8 @@
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Process.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Support/raw_ostream.h>
 #pragma GCC diagnostic pop
 
 #include "AST.h"
@@ -49,116 +69,385 @@ namespace pillar
     static constexpr clang::SourceLocation kEmptyLoc;
     static const clang::FPOptionsOverride kEmptyFPO;
 
-    class LLVMInitializer
+    using InitFunc = void (*)(void);
+
+    // The initialization functions of one LLVM backend, e.g. `X86`. Backends
+    // without an assembly printer or parser have null entries.
+    struct Backend
+    {
+      const char *name;
+      InitFunc info;
+      InitFunc target;
+      InitFunc mc;
+      InitFunc asm_printer{nullptr};
+      InitFunc asm_parser{nullptr};
+      bool initialized{false};
+    };
+
+    // Initializes LLVM's backends on demand, rather than all of them when the
+    // library is loaded. Only the `TargetInfo`s of every backend are registered
+    // up front, which is cheap, and lets the `TargetRegistry` tell us which
+    // backend handles a given triple.
+    class LLVMTargets
     {
+    private:
+      // Tear down LLVM's managed statics at exit.
+      llvm::llvm_shutdown_obj shutdown;
+
+      std::mutex lock;
+      std::vector<Backend> backends;
+      llvm::DenseMap<const llvm::Target *, Backend *> target_to_backend;
+
+      static void Initialize(Backend &backend)
+      {
+        if (!backend.initialized)
+        {
+          backend.target();
+          backend.mc();
+          if (backend.asm_printer)
+          {
+            backend.asm_printer();
+          }
+          if (backend.asm_parser)
+          {
+            backend.asm_parser();
+          }
+          backend.initialized = true;
+        }
+      }
+
     public:
-      LLVMInitializer(void)
+      LLVMTargets(void)
       {
         // We're a library, and we *don't* want LLVM to do any crash recovery on
         // our behalf.
         llvm::CrashRecoveryContext::Disable();
-        llvm::InitializeAllTargets();
-        llvm::InitializeAllTargetMCs();
-        llvm::InitializeAllAsmPrinters();
-        llvm::InitializeAllAsmParsers();
         llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+#define LLVM_TARGET(name)                                          \
+  backends.push_back({#name, LLVMInitialize##name##TargetInfo,     \
+                      LLVMInitialize##name##Target,                \
+                      LLVMInitialize##name##TargetMC});
+#include <llvm/Config/Targets.def>
+
+        auto find_backend = [this](llvm::StringRef name) -> Backend *
+        {
+          for (Backend &backend : backends)
+          {
+            if (name == backend.name)
+            {
+              return &backend;
+            }
+          }
+          return nullptr;
+        };
+
+#define LLVM_ASM_PRINTER(name)                                     \
+  if (Backend *backend = find_backend(#name))                      \
+  {                                                                \
+    backend->asm_printer = LLVMInitialize##name##AsmPrinter;       \
+  }
+#include <llvm/Config/AsmPrinters.def>
+
+#define LLVM_ASM_PARSER(name)                                      \
+  if (Backend *backend = find_backend(#name))                      \
+  {                                                                \
+    backend->asm_parser = LLVMInitialize##name##AsmParser;         \
+  }
+#include <llvm/Config/AsmParsers.def>
+
+        // One backend may register several targets (e.g. `X86` registers both
+        // `x86` and `x86-64`), so attribute each newly registered target to
+        // the backend that registered it.
+        for (Backend &backend : backends)
+        {
+          backend.info();
+          for (const llvm::Target &target : llvm::TargetRegistry::targets())
+          {
+            target_to_backend.try_emplace(&target, &backend);
+          }
+        }
+      }
+
+      bool Initialize(const llvm::Triple &triple)
+      {
+        std::string error;
+        const llvm::Target *target = llvm::TargetRegistry::lookupTarget(
+            triple.str().empty() ? llvm::sys::getDefaultTargetTriple()
+                                 : triple.str(),
+            error);
+        if (!target)
+        {
+          return false;
+        }
+
+        auto it = target_to_backend.find(target);
+        if (it == target_to_backend.end())
+        {
+          return false;
+        }
+
+        std::lock_guard<std::mutex> locker(lock);
+        Initialize(*(it->second));
+        return true;
       }
 
-      ~LLVMInitializer(void)
+      void InitializeAll(void)
       {
-        llvm::llvm_shutdown();
+        std::lock_guard<std::mutex> locker(lock);
+        for (Backend &backend : backends)
+        {
+          Initialize(backend);
+        }
       }
     };
 
-    static LLVMInitializer gLLVM;
+    static LLVMTargets &GetLLVMTargets(void)
+    {
+      static LLVMTargets targets;
+      return targets;
+    }
 
-    static std::vector<std::string> Arguments(const llvm::Triple &triple)
+    // Rendering a large module produces a lot of small writes, so coalesce
+    // them into big ones.
+    static constexpr size_t kOutputBufferSize = 1u << 20u;
+
+    // Serialize the AST in `sema` the way that `clang -emit-ast` does, i.e. as
+    // a PCH in a raw (rather than object file) container. Returns `false` if
+    // the AST couldn't be serialized.
+    static bool WriteAST(llvm::raw_ostream &os, clang::Sema &sema)
     {
-      std::vector<std::string> args;
-      args.emplace_back("-target");
-      args.push_back(triple.normalize());
-      return args;
+      auto module_cache = llvm::makeIntrusiveRefCnt<clang::InMemoryModuleCache>();
+      auto buffer = std::make_shared<clang::PCHBuffer>();
+
+      // Leave out timestamps, so that the same input always produces the same
+      // file. Lifting doesn't report errors through `Sema`'s diagnostics, so
+      // write the AST even if `Sema` complained along the way.
+      clang::PCHGenerator generator(
+          sema.getPreprocessor(), *module_cache, /*OutputFile=*/"",
+          /*isysroot=*/"", buffer, /*Extensions=*/{},
+          /*AllowASTWithErrors=*/true, /*IncludeTimestamps=*/false);
+      generator.InitializeSema(sema);
+      generator.HandleTranslationUnit(sema.getASTContext());
+      generator.ForgetSema();
+
+      if (!buffer->IsComplete)
+      {
+        return false;
+      }
+      os.write(buffer->Data.data(), buffer->Data.size());
+      return true;
     }
 
-    enum CExprPrecedence : unsigned
+    static bool EmitTo(llvm::raw_ostream &os, ClangModuleImpl &impl,
+                       const EmitOptions &options,
+                       std::vector<PrintedDecl> *printed = nullptr)
     {
-      Value = 0U,
-      SpecialOp,
-      UnaryOp,
-      BinaryOp = UnaryOp + clang::UO_LNot + 1U,
-      CondOp = BinaryOp + clang::BO_Comma + 1U
-    };
+      const clang::TranslationUnitDecl *tu = impl.ctx.getTranslationUnitDecl();
 
-    static unsigned GetOperatorPrecedence(clang::UnaryOperatorKind opc)
+      // Definitions printed elsewhere only exist as C, so Clang's dumps and
+      // serialized ASTs would silently be missing their bodies.
+      if (options.mode != OutputMode::kNone &&
+          options.mode != OutputMode::kCSource &&
+          !impl.printed_definitions.empty())
+      {
+        return false;
+      }
+
+      switch (options.mode)
+      {
+      case OutputMode::kNone:
+        break;
+      case OutputMode::kCSource:
+        return PrintInParallel(os, tu, options.num_threads,
+                               impl.printed_definitions, printed);
+      case OutputMode::kASTDump:
+        tu->dump(os);
+        break;
+      case OutputMode::kJSONAST:
+        tu->dump(os, /*Deserialize=*/false, clang::ADOF_JSON);
+        break;
+      case OutputMode::kSerializedAST:
+        return WriteAST(os, impl.sema);
+      }
+      return true;
+    }
+
+    static bool Finish(llvm::raw_fd_ostream &os)
     {
-      return static_cast<unsigned>(CExprPrecedence::UnaryOp) +
-             static_cast<unsigned>(opc);
+      os.flush();
+      if (os.has_error())
+      {
+        os.clear_error();
+        return false;
+      }
+      return true;
     }
 
-    static unsigned GetOperatorPrecedence(clang::BinaryOperatorKind opc)
+    // Whether to write an index alongside the C code written to `path`.
+    static bool WantsIndex(std::string_view path, const EmitOptions &options)
     {
-      return static_cast<unsigned>(CExprPrecedence::BinaryOp) +
-             static_cast<unsigned>(opc);
+      return options.write_index && options.mode == OutputMode::kCSource &&
+             path != "-";
     }
 
-    static unsigned GetOperatorPrecedence(clang::Expr *op)
+    static std::string IndexPath(std::string_view path)
     {
-      if (auto cast = clang::dyn_cast<clang::ImplicitCastExpr>(op))
+      return std::string(path) + ".idx";
+    }
+
+    static bool EmitToFile(llvm::raw_fd_ostream &os, ClangModuleImpl &impl,
+                           const EmitOptions &options,
+                           std::vector<PrintedDecl> *printed = nullptr)
+    {
+      os.SetBufferSize(kOutputBufferSize);
+      const bool emitted = EmitTo(os, impl, options, printed);
+      return Finish(os) && emitted;
+    }
+
+    static bool Agrees(clang::ASTContext &ctx, const clang::Expr *trusted,
+                       const clang::Expr *checked)
+    {
+      if (trusted->getValueKind() != checked->getValueKind() ||
+          !ctx.hasSameType(trusted->getType(), checked->getType()))
+      {
+        return false;
+      }
+
+      auto trusted_cao = clang::dyn_cast<clang::CompoundAssignOperator>(trusted);
+      auto checked_cao = clang::dyn_cast<clang::CompoundAssignOperator>(checked);
+      if (!trusted_cao || !checked_cao)
+      {
+        return !trusted_cao && !checked_cao;
+      }
+
+      return ctx.hasSameType(trusted_cao->getComputationLHSType(),
+                             checked_cao->getComputationLHSType()) &&
+             ctx.hasSameType(trusted_cao->getComputationResultType(),
+                             checked_cao->getComputationResultType());
+    }
+
+    // The integer promotions (C11 6.3.1.1p2), including those of bit-fields.
+    static clang::QualType Promote(clang::ASTContext &ctx,
+                                   const clang::Expr *expr)
+    {
+      clang::QualType type = expr->getType().getAtomicUnqualifiedType();
+      if (clang::QualType bit_field = ctx.isPromotableBitField(
+              const_cast<clang::Expr *>(expr));
+          !bit_field.isNull())
       {
-        return GetOperatorPrecedence(cast->getSubExpr());
+        return bit_field;
       }
+      if (ctx.isPromotableIntegerType(type))
+      {
+        return ctx.getPromotedIntegerType(type);
+      }
+      return type;
+    }
 
-      if (clang::isa<clang::DeclRefExpr>(op) ||
-          clang::isa<clang::IntegerLiteral>(op) ||
-          clang::isa<clang::FloatingLiteral>(op) ||
-          clang::isa<clang::InitListExpr>(op) ||
-          clang::isa<clang::CompoundLiteralExpr>(op) ||
-          clang::isa<clang::ParenExpr>(op) ||
-          clang::isa<clang::StringLiteral>(op))
+    // The usual arithmetic conversions (C11 6.3.1.8) of two promoted types.
+    static clang::QualType CommonArithmeticType(clang::ASTContext &ctx,
+                                                clang::QualType lhs,
+                                                clang::QualType rhs)
+    {
+      if (ctx.hasSameType(lhs, rhs))
       {
-        return CExprPrecedence::Value;
+        return lhs;
       }
 
-      if (clang::isa<clang::MemberExpr>(op) ||
-          clang::isa<clang::ArraySubscriptExpr>(op) ||
-          clang::isa<clang::CallExpr>(op))
+      if (lhs->isFloatingType() || rhs->isFloatingType())
       {
-        return CExprPrecedence::SpecialOp;
+        clang::QualType real = lhs;
+        if (!lhs->isFloatingType() ||
+            (rhs->isFloatingType() && ctx.getFloatingTypeOrder(lhs, rhs) < 0))
+        {
+          real = rhs;
+        }
+        if (auto complex = real->getAs<clang::ComplexType>())
+        {
+          real = complex->getElementType();
+        }
+        if (lhs->isComplexType() || rhs->isComplexType())
+        {
+          return ctx.getComplexType(real);
+        }
+        return real;
       }
 
-      if (clang::isa<clang::CStyleCastExpr>(op))
+      const bool lhs_signed = lhs->hasSignedIntegerRepresentation();
+      const bool rhs_signed = rhs->hasSignedIntegerRepresentation();
+      const int order = ctx.getIntegerTypeOrder(lhs, rhs);
+      if (lhs_signed == rhs_signed)
       {
-        return CExprPrecedence::UnaryOp;
+        return order >= 0 ? lhs : rhs;
       }
 
-      if (auto uo = clang::dyn_cast<clang::UnaryOperator>(op))
+      clang::QualType signed_type = lhs_signed ? lhs : rhs;
+      clang::QualType unsigned_type = lhs_signed ? rhs : lhs;
+      if ((lhs_signed ? -order : order) >= 0)
       {
-        return GetOperatorPrecedence(uo->getOpcode());
+        return unsigned_type;
       }
+      if (ctx.getIntWidth(signed_type) > ctx.getIntWidth(unsigned_type))
+      {
+        return signed_type;
+      }
+      return ctx.getCorrespondingUnsignedType(signed_type);
+    }
 
-      if (auto bo = clang::dyn_cast<clang::BinaryOperator>(op))
+    // The type in which `lhs op= rhs` is computed, before the result is
+    // converted back to the type of `lhs`. As with `Sema`, it's the type of
+    // `lhs` for pointer arithmetic, the promoted type of `lhs` for shifts, and
+    // otherwise the result of the usual arithmetic conversions.
+    static clang::QualType ComputationType(clang::ASTContext &ctx,
+                                           clang::BinaryOperatorKind opc,
+                                           const clang::Expr *lhs,
+                                           const clang::Expr *rhs)
+    {
+      clang::QualType lhs_type = lhs->getType().getAtomicUnqualifiedType();
+      if (lhs_type->isPointerType())
       {
-        return GetOperatorPrecedence(bo->getOpcode());
+        return lhs_type;
       }
 
-      if (clang::isa<clang::ConditionalOperator>(op))
+      clang::QualType promoted_lhs = Promote(ctx, lhs);
+      if (opc == clang::BO_ShlAssign || opc == clang::BO_ShrAssign)
       {
-        return CExprPrecedence::CondOp;
+        return promoted_lhs;
       }
 
-      assert(false);
-      return 0U;
+      return CommonArithmeticType(ctx, promoted_lhs, Promote(ctx, rhs));
+    }
+
+    // Describe how the trusted builders and `Sema` disagree on `what`.
+    // `checked` is `nullptr` if `Sema` rejected it outright.
+    static std::string Disagreement(llvm::StringRef what,
+                                    const clang::Expr *trusted,
+                                    const clang::Expr *checked)
+    {
+      std::string message;
+      llvm::raw_string_ostream os(message);
+      os << "Trusted builder disagrees with Sema on " << what << ": built `"
+         << trusted->getType().getAsString() << "`";
+      if (checked)
+      {
+        os << ", Sema built `" << checked->getType().getAsString() << "`";
+      }
+      else
+      {
+        os << ", Sema rejected it";
+      }
+      return os.str();
     }
 
   } // namespace
 
   ClangModule::~ClangModule(void) {}
 
-  std::optional<ClangModule> ClangModule::Lift(const VASTModule &module)
+  std::optional<ClangModule> ClangModule::Lift(const VASTModule &module,
+                                               const LiftOptions &options)
   {
-    std::shared_ptr<mlir::Operation> op(module.impl,
-                                        module.impl->module->getOperation());
-    if (auto ptr = ast::AST::CreateFromModule(std::move(op)))
+    if (auto ptr = ast::AST::CreateFromModule(module.impl, options))
     {
       return ClangModule(ptr);
     }
@@ -168,17 +457,227 @@ namespace pillar
     }
   }
 
-  ClangModuleImpl::~ClangModuleImpl(void)
+  std::optional<ClangModule> ClangModule::LiftOnDemand(
+      const VASTModule &module, const LiftOptions &options)
   {
-    (void)llvm;
+    if (auto ptr = ast::AST::CreateEmpty(module.impl, options))
+    {
+      return ClangModule(ptr);
+    }
+    else
+    {
+      return std::nullopt;
+    }
+  }
+
+  bool ClangModule::LiftFunction(std::string_view name)
+  {
+    auto &lifter = static_cast<ast::AST &>(*impl);
+    return lifter.LiftFunction(llvm::StringRef(name.data(), name.size())) !=
+           nullptr;
+  }
+
+  bool ClangModule::Update(const VASTModule &revision)
+  {
+    auto &lifter = static_cast<ast::AST &>(*impl);
+    if (lifter.Update(revision.impl))
+    {
+      return true;
+    }
+
+    if (auto ptr = lifter.CreateFromRevision(revision.impl))
+    {
+      impl = std::move(ptr);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  bool ClangModule::Relift(const std::vector<std::string> &names)
+  {
+    auto &lifter = static_cast<ast::AST &>(*impl);
+    return lifter.Relift(llvm::ArrayRef<std::string>(names));
+  }
+
+  bool ClangModule::LiftAndEmit(const VASTModule &module,
+                                std::string_view path,
+                                const LiftOptions &lift_options,
+                                const EmitOptions &emit_options)
+  {
+    // Clang's dumps and serialized ASTs are of the whole translation unit, so
+    // there's nothing to stream. They need every body in the AST, so these
+    // are lifted on one thread and without the function cache.
+    if (emit_options.mode == OutputMode::kASTDump ||
+        emit_options.mode == OutputMode::kJSONAST ||
+        emit_options.mode == OutputMode::kSerializedAST)
+    {
+      LiftOptions serial_options = lift_options;
+      serial_options.num_lift_threads = 1u;
+      serial_options.function_cache_dir.clear();
+      auto maybe_ast = Lift(module, serial_options);
+      return maybe_ast && maybe_ast->Emit(path, emit_options);
+    }
+
+    std::shared_ptr<ast::AST> ast =
+        ast::AST::CreateDeclsFromModule(module.impl, lift_options);
+    if (!ast)
+    {
+      return false;
+    }
+
+    if (emit_options.mode == OutputMode::kNone)
+    {
+      while (ast->LiftNextBody())
+      {
+      }
+      return true;
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(llvm::StringRef(path.data(), path.size()), ec,
+                            llvm::sys::fs::OF_None);
+    if (ec)
+    {
+      return false;
+    }
+    os.SetBufferSize(kOutputBufferSize);
+
+    // No function has a body yet, so this declares all of them.
+    const bool wants_index = WantsIndex(path, emit_options);
+    std::vector<PrintedDecl> printed;
+    if (!EmitTo(os, *ast, emit_options, wants_index ? &printed : nullptr))
+    {
+      return false;
+    }
+
+    // As when printing the translation unit, the statement printer ends each
+    // body with a newline.
+    const clang::PrintingPolicy policy = ast->ctx.getPrintingPolicy();
+    while (clang::FunctionDecl *func = ast->LiftNextBody())
+    {
+      const uint64_t begin = os.tell();
+      if (auto it = ast->printed_definitions.find(func);
+          it != ast->printed_definitions.end())
+      {
+        os << it->second;
+        ast->printed_definitions.erase(it);
+      }
+      else if (func->doesThisDeclarationHaveABody())
+      {
+        func->print(os, policy, /*Indentation=*/0u);
+      }
+      else
+      {
+        continue;
+      }
+
+      if (wants_index)
+      {
+        printed.push_back({func, true, begin, os.tell() - begin});
+      }
+    }
+
+    if (!Finish(os))
+    {
+      return false;
+    }
+    return !wants_index || WriteIndex(IndexPath(path), printed);
   }
 
-  ClangModuleImpl::ClangModuleImpl(const llvm::Triple &triple)
-      : llvm(&gLLVM),
-        unit(clang::tooling::buildASTFromCodeWithArgs("", Arguments(triple),
-                                                      "pillar.c")),
-        ctx(unit->getASTContext()),
-        sema(unit->getSema()) {}
+  bool ClangModule::InitializeTarget(std::string_view triple)
+  {
+    return GetLLVMTargets().Initialize(llvm::Triple(triple));
+  }
+
+  void ClangModule::InitializeAllTargets(void)
+  {
+    GetLLVMTargets().InitializeAll();
+  }
+
+  FunctionCacheStats ClangModule::CacheStats(void)
+  {
+    return {FunctionCache::NumHits(), FunctionCache::NumMisses()};
+  }
+
+  void ClangModule::Print(std::ostream &os) const
+  {
+    llvm::raw_os_ostream llvm_os(os);
+    (void)EmitTo(llvm_os, *impl, EmitOptions{});
+  }
+
+  bool ClangModule::Emit(std::string_view path,
+                         const EmitOptions &options) const
+  {
+    if (options.mode == OutputMode::kNone)
+    {
+      return true;
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(llvm::StringRef(path.data(), path.size()), ec,
+                            llvm::sys::fs::OF_None);
+    if (ec)
+    {
+      return false;
+    }
+
+    const bool wants_index = WantsIndex(path, options);
+    std::vector<PrintedDecl> printed;
+    return EmitToFile(os, *impl, options, wants_index ? &printed : nullptr) &&
+           (!wants_index || WriteIndex(IndexPath(path), printed));
+  }
+
+  bool ClangModule::Emit(int fd, const EmitOptions &options) const
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/false);
+    return EmitToFile(os, *impl, options);
+  }
+
+  bool ClangModule::Emit(std::ostream &os, const EmitOptions &options) const
+  {
+    llvm::raw_os_ostream llvm_os(os);
+    const bool emitted = EmitTo(llvm_os, *impl, options);
+    llvm_os.flush();
+    return emitted && os.good();
+  }
+
+  ClangModuleImpl::~ClangModuleImpl(void) {}
+
+  ClangModuleImpl::ClangModuleImpl(std::unique_ptr<ClangUnit> unit_,
+                                   const LiftOptions &options)
+      : unit(std::move(unit_)),
+        builder_mode(options.builder_mode),
+        diagnostic_handler(options.diagnostic_handler),
+        ctx(unit->Context()),
+        sema(unit->Sema()) {}
+
+  void ClangModuleImpl::Diagnose(std::string_view message) const
+  {
+    if (diagnostic_handler)
+    {
+      diagnostic_handler(message);
+    }
+  }
+
+  std::unique_ptr<ClangUnit> ClangModuleImpl::CreateUnit(
+      const llvm::Triple &triple, const LiftOptions &options)
+  {
+    // Clang's own `TargetInfo` doesn't need the LLVM backend, so lifting
+    // doesn't fail if LLVM wasn't built with one for `triple`.
+    (void)GetLLVMTargets().Initialize(triple);
+
+    if (options.lean_frontend)
+    {
+      return ClangUnitFactory::CreateLean(triple);
+    }
+    else
+    {
+      return ClangUnitFactory::Create(triple);
+    }
+  }
 
   clang::IdentifierInfo *ClangModuleImpl::CreateIdentifier(
       const llvm::StringRef &str)
@@ -242,23 +741,111 @@ namespace pillar
     return record_decl;
   }
 
-  clang::DoStmt *ClangModuleImpl::CreateDo(clang::Expr *cond, clang::Stmt *body)
+  // VAST makes the lvalue-to-rvalue conversion of conditions explicit, so this
+  // is normally a no-op.
+  clang::Expr *ClangModuleImpl::CreateTrustedCondition(clang::Expr *expr)
   {
-    clang::ExprResult er = sema.CheckBooleanCondition(kEmptyLoc, cond);
-    assert(er.isUsable());
-    er = sema.ActOnFinishFullExpr(er.get(), kEmptyLoc, /*DiscardedValue=*/false);
+    if (!expr->isGLValue())
+    {
+      return expr;
+    }
+    return clang::ImplicitCastExpr::Create(
+        ctx, expr->getType().getUnqualifiedType(), clang::CK_LValueToRValue,
+        expr, /*BasePath=*/nullptr, clang::VK_PRValue, kEmptyFPO);
+  }
+
+  clang::Expr *ClangModuleImpl::CreateCondition(clang::Expr *expr)
+  {
+    clang::Expr *trusted = nullptr;
+    if (builder_mode != BuilderMode::kSema)
+    {
+      trusted = CreateTrustedCondition(expr);
+      if (builder_mode == BuilderMode::kTrusted)
+      {
+        return trusted;
+      }
+    }
+
+    clang::ExprResult er = sema.CheckBooleanCondition(kEmptyLoc, expr);
+    if (er.isUsable())
+    {
+      er = sema.ActOnFinishFullExpr(er.get(), kEmptyLoc,
+                                    /*DiscardedValue=*/false);
+    }
+
+    if (trusted)
+    {
+      if (!er.isUsable())
+      {
+        Diagnose(Disagreement("a condition", trusted, nullptr));
+        return trusted;
+      }
+      if (!Agrees(ctx, trusted, er.get()))
+      {
+        Diagnose(Disagreement("a condition", trusted, er.get()));
+      }
+    }
+
     assert(er.isUsable());
-    return new (ctx) clang::DoStmt(body, er.get(), kEmptyLoc, kEmptyLoc,
-                                   kEmptyLoc);
+    return er.get();
+  }
+
+  clang::DoStmt *ClangModuleImpl::CreateDo(clang::Expr *cond, clang::Stmt *body)
+  {
+    return new (ctx) clang::DoStmt(body, CreateCondition(cond), kEmptyLoc,
+                                   kEmptyLoc, kEmptyLoc);
+  }
+
+  // Mirrors what `Sema` works out for a reference in C: functions and
+  // enumerators are prvalues, and everything else (variables and parameters) is
+  // an lvalue.
+  clang::DeclRefExpr *ClangModuleImpl::CreateTrustedDeclRef(
+      clang::ValueDecl *val)
+  {
+    clang::ExprValueKind vk = clang::VK_LValue;
+    if (clang::isa<clang::FunctionDecl>(val) ||
+        clang::isa<clang::EnumConstantDecl>(val))
+    {
+      vk = clang::VK_PRValue;
+    }
+    val->setReferenced();
+
+    return clang::DeclRefExpr::Create(
+        ctx, clang::NestedNameSpecifierLoc(), kEmptyLoc, val,
+        /*RefersToEnclosingVariableOrCapture=*/false, kEmptyLoc,
+        val->getType().getNonReferenceType(), vk);
   }
 
   clang::DeclRefExpr *ClangModuleImpl::CreateDeclRef(clang::ValueDecl *val)
   {
+    clang::DeclRefExpr *trusted = nullptr;
+    if (builder_mode != BuilderMode::kSema)
+    {
+      trusted = CreateTrustedDeclRef(val);
+      if (builder_mode == BuilderMode::kTrusted)
+      {
+        return trusted;
+      }
+    }
+
     clang::DeclarationNameInfo dni(val->getDeclName(), kEmptyLoc);
     clang::CXXScopeSpec ss;
     clang::ExprResult er = sema.BuildDeclarationNameExpr(ss, dni, val);
-    assert(er.isUsable());
-    clang::DeclRefExpr *dre = er.getAs<clang::DeclRefExpr>();
+    clang::DeclRefExpr *dre =
+        er.isUsable() ? er.getAs<clang::DeclRefExpr>() : nullptr;
+
+    if (trusted)
+    {
+      if (!dre || !Agrees(ctx, trusted, dre))
+      {
+        Diagnose(Disagreement(val->getName(), trusted, dre));
+      }
+      if (!dre)
+      {
+        return trusted;
+      }
+    }
+
     assert(dre != nullptr);
     return dre;
   }
@@ -269,11 +856,8 @@ namespace pillar
   }
   clang::IfStmt *ClangModuleImpl::CreateIf(clang::Expr *cond, clang::Stmt *then_val, bool has_else, clang::Stmt *else_val)
   {
-    auto cr{sema.ActOnCondition(/*Scope=*/nullptr, kEmptyLoc, cond,
-                                clang::Sema::ConditionKind::Boolean)};
-    assert(!cr.isInvalid());
     auto if_stmt{clang::IfStmt::CreateEmpty(ctx, has_else, false, false)};
-    if_stmt->setCond(cr.get().second);
+    if_stmt->setCond(CreateCondition(cond));
     if_stmt->setThen(then_val);
     if (has_else)
       if_stmt->setElse(else_val);
@@ -297,37 +881,111 @@ namespace pillar
     return new (ctx) clang::ParenExpr(kEmptyLoc, kEmptyLoc, expr);
   }
 
-  clang::UnaryOperator *ClangModuleImpl::CreateUnaryOp(
-      clang::UnaryOperatorKind opc, clang::Expr *expr)
+  // In C, only a dereference yields an lvalue; everything else yields an
+  // unqualified prvalue.
+  clang::UnaryOperator *ClangModuleImpl::CreateTrustedUnaryOp(
+      clang::UnaryOperatorKind opc, clang::Expr *expr, clang::QualType type)
+  {
+    clang::ExprValueKind vk = clang::VK_LValue;
+    if (opc != clang::UO_Deref)
+    {
+      vk = clang::VK_PRValue;
+      type = type.getUnqualifiedType();
+    }
+    const bool can_overflow =
+        clang::UnaryOperator::isIncrementDecrementOp(opc) ||
+        opc == clang::UO_Minus;
+    return clang::UnaryOperator::Create(ctx, expr, opc, type, vk,
+                                        clang::OK_Ordinary, kEmptyLoc,
+                                        can_overflow, kEmptyFPO);
+  }
+
+  // In C, every binary operator, including assignment, yields an unqualified
+  // prvalue. Compound assignments also record the type they're computed in,
+  // e.g. `int` for `c += 1` where `c` is a `char`.
+  clang::BinaryOperator *ClangModuleImpl::CreateTrustedBinaryOp(
+      clang::BinaryOperatorKind opc, clang::Expr *lhs, clang::Expr *rhs,
+      clang::QualType type)
   {
+    type = type.getUnqualifiedType();
+    if (clang::BinaryOperator::isCompoundAssignmentOp(opc))
+    {
+      clang::QualType comp_type = ComputationType(ctx, opc, lhs, rhs);
+      return clang::CompoundAssignOperator::Create(
+          ctx, lhs, rhs, opc, type, clang::VK_PRValue, clang::OK_Ordinary,
+          kEmptyLoc, kEmptyFPO, /*CompLHSType=*/comp_type,
+          /*CompResultType=*/comp_type);
+    }
+    return clang::BinaryOperator::Create(ctx, lhs, rhs, opc, type,
+                                         clang::VK_PRValue, clang::OK_Ordinary,
+                                         kEmptyLoc, kEmptyFPO);
+  }
 
-    if (GetOperatorPrecedence(opc) < GetOperatorPrecedence(expr))
+  clang::UnaryOperator *ClangModuleImpl::CreateUnaryOp(
+      clang::UnaryOperatorKind opc, clang::Expr *expr, clang::QualType type)
+  {
+    clang::UnaryOperator *trusted = nullptr;
+    if (builder_mode != BuilderMode::kSema && !type.isNull())
     {
-      expr = CreateParen(expr);
+      trusted = CreateTrustedUnaryOp(opc, expr, type);
+      if (builder_mode == BuilderMode::kTrusted)
+      {
+        return trusted;
+      }
     }
 
     clang::ExprResult er = sema.CreateBuiltinUnaryOp(kEmptyLoc, opc, expr);
-    assert(er.isUsable());
-    clang::UnaryOperator *uo = er.getAs<clang::UnaryOperator>();
+    clang::UnaryOperator *uo =
+        er.isUsable() ? er.getAs<clang::UnaryOperator>() : nullptr;
+
+    if (trusted)
+    {
+      if (!uo || !Agrees(ctx, trusted, uo))
+      {
+        Diagnose(Disagreement(clang::UnaryOperator::getOpcodeStr(opc), trusted,
+                              uo));
+      }
+      if (!uo)
+      {
+        return trusted;
+      }
+    }
+
     assert(uo != nullptr);
     return uo;
   }
 
   clang::BinaryOperator *ClangModuleImpl::CreateBinaryOp(
       clang::BinaryOperatorKind opc, clang::Expr *lhs,
-      clang::Expr *rhs)
+      clang::Expr *rhs, clang::QualType type)
   {
-    if (GetOperatorPrecedence(opc) < GetOperatorPrecedence(lhs))
+    clang::BinaryOperator *trusted = nullptr;
+    if (builder_mode != BuilderMode::kSema && !type.isNull())
     {
-      lhs = CreateParen(lhs);
+      trusted = CreateTrustedBinaryOp(opc, lhs, rhs, type);
+      if (builder_mode == BuilderMode::kTrusted)
+      {
+        return trusted;
+      }
     }
-    if (GetOperatorPrecedence(opc) < GetOperatorPrecedence(rhs))
+
+    clang::ExprResult er = sema.CreateBuiltinBinOp(kEmptyLoc, opc, lhs, rhs);
+    clang::BinaryOperator *bo =
+        er.isUsable() ? er.getAs<clang::BinaryOperator>() : nullptr;
+
+    if (trusted)
     {
-      rhs = CreateParen(rhs);
+      if (!bo || !Agrees(ctx, trusted, bo))
+      {
+        Diagnose(Disagreement(clang::BinaryOperator::getOpcodeStr(opc),
+                              trusted, bo));
+      }
+      if (!bo)
+      {
+        return trusted;
+      }
     }
-    clang::ExprResult er = sema.CreateBuiltinBinOp(kEmptyLoc, opc, lhs, rhs);
-    assert(er.isUsable());
-    clang::BinaryOperator *bo = er.getAs<clang::BinaryOperator>();
+
     assert(bo != nullptr);
     return bo;
   }
@@ -7,9 +7,20 @@
 #pragma once
 
 #include <pillar/Clang.h>
-#include <clang/AST/OperationKinds.h>
 #include <vector>
 
+#include "Printer.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/OperationKinds.h>
+#include <clang/AST/Type.h>
+#include <clang/Basic/Specifiers.h>
+#pragma GCC diagnostic pop
+
 namespace llvm
 {
   class StringRef;
@@ -18,8 +29,8 @@ namespace llvm
 namespace clang
 {
   class ASTContext;
-  class ASTUnit;
   class BinaryOperator;
+  class Decl;
   class RecordDecl;
   class FieldDecl;
   class DeclContext;
@@ -29,7 +40,6 @@ namespace clang
   class FunctionDecl;
   class IdentifierInfo;
   class ParenExpr;
-  class QualType;
   class ReturnStmt;
   class Sema;
   class Stmt;
@@ -48,23 +58,60 @@ namespace vast
 namespace pillar
 {
 
+  class ClangUnit;
+
   class ClangModuleImpl
   {
 
-    // Force us to initialize LLVM.
-    const void *const llvm;
+    // An empty translation unit from the `ClangUnitFactory`.
+    std::unique_ptr<ClangUnit> unit;
 
-    // An empty ASTUnit initialized from parsing empty code.
-    std::unique_ptr<clang::ASTUnit> unit;
+    const BuilderMode builder_mode;
+
+    const std::function<void(std::string_view)> diagnostic_handler;
 
     ClangModuleImpl(void) = delete;
 
+    // Make `expr` usable as the condition of an `if` or `do` statement.
+    clang::Expr *CreateCondition(clang::Expr *expr);
+
+    clang::Expr *CreateTrustedCondition(clang::Expr *expr);
+    clang::DeclRefExpr *CreateTrustedDeclRef(clang::ValueDecl *val);
+    clang::UnaryOperator *CreateTrustedUnaryOp(clang::UnaryOperatorKind opc,
+                                               clang::Expr *expr,
+                                               clang::QualType type);
+    clang::BinaryOperator *CreateTrustedBinaryOp(clang::BinaryOperatorKind opc,
+                                                 clang::Expr *lhs,
+                                                 clang::Expr *rhs,
+                                                 clang::QualType type);
+
   public:
     clang::ASTContext &ctx;
     clang::Sema &sema;
 
+    // Functions that are only declared in the AST, and whose definitions were
+    // instead printed elsewhere, i.e. taken from the function cache, or lifted
+    // and printed by another thread.
+    PrintedDefinitions printed_definitions;
+
     virtual ~ClangModuleImpl(void);
-    explicit ClangModuleImpl(const llvm::Triple &triple);
+    explicit ClangModuleImpl(std::unique_ptr<ClangUnit> unit_,
+                             const LiftOptions &options);
+
+    // Create the empty translation unit that a module for `triple` is lifted
+    // into. Returns `nullptr` if Clang can't be set up for `triple`.
+    static std::unique_ptr<ClangUnit> CreateUnit(const llvm::Triple &triple,
+                                                 const LiftOptions &options);
+
+    // Whether there's a diagnostic handler, so that messages that would be
+    // dropped needn't be formatted.
+    inline bool HasDiagnosticHandler(void) const
+    {
+      return static_cast<bool>(diagnostic_handler);
+    }
+
+    // Pass `message` to the diagnostic handler from `LiftOptions`, if any.
+    void Diagnose(std::string_view message) const;
 
     clang::IdentifierInfo *CreateIdentifier(const llvm::StringRef &name);
 
@@ -96,133 +143,174 @@ namespace pillar
     clang::WhileStmt *CreateWhile(clang::Expr *cond, clang::Stmt *body);
     clang::ForStmt *CreateFor(clang::Expr *init, clang::Expr *cond, clang::Expr *inc, clang::Stmt *body);
     clang::DeclRefExpr *CreateDeclRef(clang::ValueDecl *val);
+
     clang::ParenExpr *CreateParen(clang::Expr *expr);
+
+    // Wrap the operands of every expression in the tree rooted at `root` in
+    // the fewest parentheses needed for the tree to print back as the same C
+    // expressions. Operators are built without any parentheses, and this runs
+    // once the tree is finished. Running it again is a no-op.
+    void Parenthesize(clang::Stmt *root);
+
+    // Parenthesize the body of a function, or the initializer of a variable.
+    void Parenthesize(clang::Decl *decl);
     clang::VarDecl *CreateVarDecl(clang::DeclContext *sdc, clang::DeclContext *ldc,
                                   const clang::QualType &type, clang::IdentifierInfo *id);
     // Unary operators
+    //
+    // If `type` is given, then it is the type of the result, as recorded in
+    // VAST, and the operator may be built without going through `Sema`.
     clang::UnaryOperator *CreateUnaryOp(clang::UnaryOperatorKind opc,
-                                        clang::Expr *expr);
+                                        clang::Expr *expr,
+                                        clang::QualType type = {});
 
-    clang::UnaryOperator *CreateDeref(clang::Expr *expr)
+    clang::UnaryOperator *CreateDeref(clang::Expr *expr,
+                                      clang::QualType type = {})
     {
-      return CreateUnaryOp(clang::UO_Deref, expr);
+      return CreateUnaryOp(clang::UO_Deref, expr, type);
     }
 
-    clang::UnaryOperator *CreateAddrOf(clang::Expr *expr)
+    clang::UnaryOperator *CreateAddrOf(clang::Expr *expr,
+                                       clang::QualType type = {})
     {
-      return CreateUnaryOp(clang::UO_AddrOf, expr);
+      return CreateUnaryOp(clang::UO_AddrOf, expr, type);
     }
 
-    clang::UnaryOperator *CreateLNot(clang::Expr *expr)
+    clang::UnaryOperator *CreateLNot(clang::Expr *expr,
+                                     clang::QualType type = {})
     {
-      return CreateUnaryOp(clang::UO_LNot, expr);
+      return CreateUnaryOp(clang::UO_LNot, expr, type);
     }
 
-    clang::UnaryOperator *CreateNot(clang::Expr *expr)
+    clang::UnaryOperator *CreateNot(clang::Expr *expr,
+                                    clang::QualType type = {})
     {
-      return CreateUnaryOp(clang::UO_Not, expr);
+      return CreateUnaryOp(clang::UO_Not, expr, type);
     }
 
     // Binary operators
+    //
+    // If `type` is given, then it is the type of the result, as recorded in
+    // VAST, and the operator may be built without going through `Sema`.
     clang::BinaryOperator *CreateBinaryOp(clang::BinaryOperatorKind opc,
-                                          clang::Expr *lhs, clang::Expr *rhs);
+                                          clang::Expr *lhs, clang::Expr *rhs,
+                                          clang::QualType type = {});
     // Logical binary operators
-    clang::BinaryOperator *CreateLAnd(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateLAnd(clang::Expr *lhs, clang::Expr *rhs,
+                                      clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_LAnd, lhs, rhs);
+      return CreateBinaryOp(clang::BO_LAnd, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateLOr(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateLOr(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_LOr, lhs, rhs);
+      return CreateBinaryOp(clang::BO_LOr, lhs, rhs, type);
     }
 
     // Comparison operators
-    clang::BinaryOperator *CreateEQ(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateEQ(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_EQ, lhs, rhs);
+      return CreateBinaryOp(clang::BO_EQ, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateNE(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateNE(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_NE, lhs, rhs);
+      return CreateBinaryOp(clang::BO_NE, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateGE(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateGE(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_GE, lhs, rhs);
+      return CreateBinaryOp(clang::BO_GE, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateGT(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateGT(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_GT, lhs, rhs);
+      return CreateBinaryOp(clang::BO_GT, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateLE(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateLE(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_LE, lhs, rhs);
+      return CreateBinaryOp(clang::BO_LE, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateLT(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateLT(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_LT, lhs, rhs);
+      return CreateBinaryOp(clang::BO_LT, lhs, rhs, type);
     }
 
     // Bitwise binary operators
-    clang::BinaryOperator *CreateAnd(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateAnd(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_And, lhs, rhs);
+      return CreateBinaryOp(clang::BO_And, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateOr(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateOr(clang::Expr *lhs, clang::Expr *rhs,
+                                    clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Or, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Or, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateXor(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateXor(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Xor, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Xor, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateShl(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateShl(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Shl, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Shl, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateShr(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateShr(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Shr, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Shr, lhs, rhs, type);
     }
 
     // Arithmetic operators
-    clang::BinaryOperator *CreateAdd(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateAdd(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Add, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Add, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateSub(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateSub(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Sub, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Sub, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateMul(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateMul(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Mul, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Mul, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateDiv(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateDiv(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Div, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Div, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateRem(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateRem(clang::Expr *lhs, clang::Expr *rhs,
+                                     clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Rem, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Rem, lhs, rhs, type);
     }
 
-    clang::BinaryOperator *CreateAssign(clang::Expr *lhs, clang::Expr *rhs)
+    clang::BinaryOperator *CreateAssign(clang::Expr *lhs, clang::Expr *rhs,
+                                        clang::QualType type = {})
     {
-      return CreateBinaryOp(clang::BO_Assign, lhs, rhs);
+      return CreateBinaryOp(clang::BO_Assign, lhs, rhs, type);
     }
 
     clang::ReturnStmt *CreateReturn(clang::Expr *val);
@@ -0,0 +1,311 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "ClangFactory.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/Basic/Builtins.h>
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/DiagnosticIDs.h>
+#include <clang/Basic/DiagnosticOptions.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/LangOptions.h>
+#include <clang/Basic/LangStandard.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Basic/TargetInfo.h>
+#include <clang/Basic/TargetOptions.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/CompilerInvocation.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Lex/HeaderSearch.h>
+#include <clang/Lex/HeaderSearchOptions.h>
+#include <clang/Lex/ModuleLoader.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Lex/PreprocessorOptions.h>
+#include <clang/Sema/Sema.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/TargetParser/Triple.h>
+#pragma GCC diagnostic pop
+
+namespace pillar
+{
+  namespace
+  {
+
+    static constexpr const char *kFileName = "pillar.c";
+
+    class ASTUnitClangUnit final : public ClangUnit
+    {
+    private:
+      std::unique_ptr<clang::ASTUnit> unit;
+
+    public:
+      explicit ASTUnitClangUnit(std::unique_ptr<clang::ASTUnit> unit_)
+          : unit(std::move(unit_)) {}
+
+      virtual ~ASTUnitClangUnit(void) = default;
+
+      clang::ASTContext &Context(void) final
+      {
+        return unit->getASTContext();
+      }
+
+      clang::Sema &Sema(void) final
+      {
+        return unit->getSema();
+      }
+    };
+
+    // A translation unit assembled by hand from its parts. The members are in
+    // dependency order, so that they are destroyed in reverse.
+    class LeanClangUnit final : public ClangUnit
+    {
+    private:
+      clang::LangOptions lang_opts;
+      std::shared_ptr<clang::TargetOptions> target_opts;
+      clang::IgnoringDiagConsumer diag_consumer;
+      clang::DiagnosticsEngine diags;
+      clang::FileSystemOptions fs_opts;
+      llvm::IntrusiveRefCntPtr<clang::FileManager> files;
+      llvm::IntrusiveRefCntPtr<clang::SourceManager> sources;
+      llvm::IntrusiveRefCntPtr<clang::TargetInfo> target;
+      std::unique_ptr<clang::HeaderSearch> header_search;
+      clang::TrivialModuleLoader module_loader;
+      std::unique_ptr<clang::Preprocessor> pp;
+      llvm::IntrusiveRefCntPtr<clang::ASTContext> ast_context;
+      clang::ASTConsumer consumer;
+      std::unique_ptr<clang::Sema> sema;
+
+    public:
+      LeanClangUnit(void)
+          : target_opts(std::make_shared<clang::TargetOptions>()),
+            diags(llvm::makeIntrusiveRefCnt<clang::DiagnosticIDs>(),
+                  llvm::makeIntrusiveRefCnt<clang::DiagnosticOptions>(),
+                  &diag_consumer, /*ShouldOwnClient=*/false) {}
+
+      virtual ~LeanClangUnit(void) = default;
+
+      bool Initialize(const llvm::Triple &triple)
+      {
+        // Mirror the driver, which targets the host when given no triple.
+        llvm::Triple target_triple = triple;
+        if (target_triple.str().empty())
+        {
+          target_triple = llvm::Triple(llvm::sys::getDefaultTargetTriple());
+        }
+        target_opts->Triple = target_triple.normalize();
+
+        files = llvm::makeIntrusiveRefCnt<clang::FileManager>(fs_opts);
+        sources = llvm::makeIntrusiveRefCnt<clang::SourceManager>(diags, *files);
+        target = clang::TargetInfo::CreateTargetInfo(diags, target_opts);
+        if (!target)
+        {
+          return false;
+        }
+
+        std::vector<std::string> includes;
+        clang::LangOptions::setLangDefaults(lang_opts, clang::Language::C,
+                                            target->getTriple(), includes);
+        target->adjust(diags, lang_opts);
+
+        // Some consumers of the `SourceManager` (e.g. the AST writer) expect a
+        // main file, even an empty one.
+        sources->setMainFileID(sources->createFileID(
+            llvm::MemoryBuffer::getMemBuffer("", kFileName)));
+
+        header_search = std::make_unique<clang::HeaderSearch>(
+            std::make_shared<clang::HeaderSearchOptions>(), *sources, diags,
+            lang_opts, target.get());
+        pp = std::make_unique<clang::Preprocessor>(
+            std::make_shared<clang::PreprocessorOptions>(), diags, lang_opts,
+            *sources, *header_search, module_loader);
+        pp->Initialize(*target);
+        pp->getBuiltinInfo().initializeBuiltins(pp->getIdentifierTable(),
+                                                lang_opts);
+
+        ast_context = llvm::makeIntrusiveRefCnt<clang::ASTContext>(
+            lang_opts, *sources, pp->getIdentifierTable(),
+            pp->getSelectorTable(), pp->getBuiltinInfo(), clang::TU_Complete);
+        ast_context->InitBuiltinTypes(*target);
+
+        sema = std::make_unique<clang::Sema>(*pp, *ast_context, consumer,
+                                             clang::TU_Complete);
+        sema->Initialize();
+
+        // After parsing, the frontend leaves `Sema` in the context of the
+        // translation unit; do the same.
+        sema->CurContext = ast_context->getTranslationUnitDecl();
+        return true;
+      }
+
+      clang::ASTContext &Context(void) final
+      {
+        return *ast_context;
+      }
+
+      clang::Sema &Sema(void) final
+      {
+        return *sema;
+      }
+    };
+
+    // Everything about building an empty translation unit that depends only on
+    // the target triple.
+    struct UnitTemplate
+    {
+      // The contents of `pillar.c`. The invocation (and every copy of it) maps
+      // `pillar.c` to this buffer, and is told to not take ownership of it.
+      std::unique_ptr<llvm::MemoryBuffer> empty_file;
+      std::shared_ptr<clang::CompilerInvocation> invocation;
+      std::shared_ptr<clang::PCHContainerOperations> pch_ops;
+    };
+
+    static std::vector<std::string> Arguments(const llvm::Triple &triple)
+    {
+      std::vector<std::string> args;
+      args.emplace_back("-target");
+      args.push_back(triple.normalize());
+      return args;
+    }
+
+    static std::unique_ptr<UnitTemplate> CreateTemplate(
+        const llvm::Triple &triple)
+    {
+      auto tmpl = std::make_unique<UnitTemplate>();
+      tmpl->empty_file = llvm::MemoryBuffer::getMemBuffer("", kFileName);
+      tmpl->pch_ops = std::make_shared<clang::PCHContainerOperations>();
+
+      // The driver checks that its inputs exist, so give it a `pillar.c` to
+      // find, layered over the real file system like a tooling invocation does.
+      auto overlay_fs = llvm::makeIntrusiveRefCnt<llvm::vfs::OverlayFileSystem>(
+          llvm::vfs::getRealFileSystem());
+      auto memory_fs = llvm::makeIntrusiveRefCnt<llvm::vfs::InMemoryFileSystem>();
+      memory_fs->addFile(kFileName, 0, llvm::MemoryBuffer::getMemBuffer(""));
+      overlay_fs->pushOverlay(memory_fs);
+
+      std::vector<std::string> args_storage = Arguments(triple);
+      std::vector<const char *> args = {"clang", "-fsyntax-only"};
+      for (const std::string &arg : args_storage)
+      {
+        args.push_back(arg.c_str());
+      }
+      args.push_back(kFileName);
+
+      clang::CreateInvocationOptions opts;
+      opts.Diags = clang::CompilerInstance::createDiagnostics(
+          new clang::DiagnosticOptions, new clang::IgnoringDiagConsumer,
+          /*ShouldOwnClient=*/true);
+      opts.VFS = overlay_fs;
+
+      std::shared_ptr<clang::CompilerInvocation> invocation =
+          clang::createInvocation(args, std::move(opts));
+      if (!invocation)
+      {
+        return nullptr;
+      }
+
+      clang::PreprocessorOptions &ppo = invocation->getPreprocessorOpts();
+      ppo.RetainRemappedFileBuffers = true;
+      ppo.addRemappedFile(kFileName, tmpl->empty_file.get());
+
+      tmpl->invocation = std::move(invocation);
+      return tmpl;
+    }
+
+    // Returns the cached template for `triple`, creating it if needed. Returns
+    // `nullptr` if the driver couldn't produce an invocation for `triple`.
+    static std::shared_ptr<const UnitTemplate> GetTemplate(
+        const llvm::Triple &triple)
+    {
+      static std::mutex lock;
+      static llvm::StringMap<std::shared_ptr<const UnitTemplate>> templates;
+
+      std::lock_guard<std::mutex> locker(lock);
+      auto [it, added] = templates.try_emplace(triple.normalize());
+      if (added)
+      {
+        it->second = CreateTemplate(triple);
+      }
+      return it->second;
+    }
+
+  } // namespace
+
+  ClangUnit::~ClangUnit(void) {}
+
+  std::unique_ptr<ClangUnit> ClangUnitFactory::Create(
+      const llvm::Triple &triple)
+  {
+    std::shared_ptr<const UnitTemplate> tmpl = GetTemplate(triple);
+    if (!tmpl)
+    {
+      return CreateWithTooling(triple);
+    }
+
+    // The `ASTUnit` may adjust its invocation, so each unit gets its own copy.
+    auto invocation =
+        std::make_shared<clang::CompilerInvocation>(*(tmpl->invocation));
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> diags =
+        clang::CompilerInstance::createDiagnostics(
+            &(invocation->getDiagnosticOpts()), new clang::IgnoringDiagConsumer,
+            /*ShouldOwnClient=*/true);
+    auto files = llvm::makeIntrusiveRefCnt<clang::FileManager>(
+        invocation->getFileSystemOpts());
+
+    std::unique_ptr<clang::ASTUnit> unit =
+        clang::ASTUnit::LoadFromCompilerInvocation(
+            std::move(invocation), tmpl->pch_ops, std::move(diags),
+            files.get());
+    if (!unit)
+    {
+      return nullptr;
+    }
+
+    return std::make_unique<ASTUnitClangUnit>(std::move(unit));
+  }
+
+  std::unique_ptr<ClangUnit> ClangUnitFactory::CreateLean(
+      const llvm::Triple &triple)
+  {
+    auto unit = std::make_unique<LeanClangUnit>();
+    if (!unit->Initialize(triple))
+    {
+      return Create(triple);
+    }
+    return unit;
+  }
+
+  std::unique_ptr<ClangUnit> ClangUnitFactory::CreateWithTooling(
+      const llvm::Triple &triple)
+  {
+    std::unique_ptr<clang::ASTUnit> unit =
+        clang::tooling::buildASTFromCodeWithArgs("", Arguments(triple),
+                                                 kFileName);
+    if (!unit)
+    {
+      return nullptr;
+    }
+    return std::make_unique<ASTUnitClangUnit>(std::move(unit));
+  }
+
+} // namespace pillar
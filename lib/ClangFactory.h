@@ -0,0 +1,60 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include <memory>
+
+namespace llvm
+{
+  class Triple;
+} // namespace llvm
+namespace clang
+{
+  class ASTContext;
+  class Sema;
+} // namespace clang
+namespace pillar
+{
+
+  // The Clang state backing one lifted module: an empty translation unit, with
+  // its `ASTContext` and `Sema`, into which declarations are lifted.
+  class ClangUnit
+  {
+  public:
+    virtual ~ClangUnit(void);
+
+    virtual clang::ASTContext &Context(void) = 0;
+    virtual clang::Sema &Sema(void) = 0;
+  };
+
+  class ClangUnitFactory
+  {
+  public:
+    // Create a fresh, empty translation unit targeting `triple`.
+    //
+    // The compiler invocation for each distinct triple is built once, by
+    // running the driver over an empty `pillar.c`, and then cached. Later units
+    // for the same triple copy the cached invocation, which skips the driver,
+    // its toolchain detection, and the virtual file system setup that a full
+    // tooling invocation would redo for every module.
+    static std::unique_ptr<ClangUnit> Create(const llvm::Triple &triple);
+
+    // Create a fresh, empty translation unit targeting `triple` without going
+    // through the frontend at all: only the `TargetInfo`, `LangOptions`,
+    // `Preprocessor` (which `Sema` requires), `ASTContext`, and `Sema` are
+    // constructed, and nothing is parsed. Falls back on `Create` if Clang has
+    // no `TargetInfo` for `triple`.
+    static std::unique_ptr<ClangUnit> CreateLean(const llvm::Triple &triple);
+
+    // Create a fresh, empty translation unit targeting `triple` by running a
+    // full tooling invocation over an empty `pillar.c`. This is the slowest
+    // path, and is kept as a fallback and as a baseline for benchmarking.
+    static std::unique_ptr<ClangUnit> CreateWithTooling(
+        const llvm::Triple &triple);
+  };
+
+} // namespace pillar
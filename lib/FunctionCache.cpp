@@ -0,0 +1,139 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "FunctionCache.h"
+
+#include <atomic>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/xxhash.h>
+#include <mlir/IR/Operation.h>
+#include <mlir/IR/OperationSupport.h>
+#pragma GCC diagnostic pop
+
+#ifndef PILLAR_VERSION
+#define PILLAR_VERSION "unknown"
+#endif
+
+namespace pillar
+{
+  namespace
+  {
+
+    static std::atomic<uint64_t> gNumHits{0u};
+    static std::atomic<uint64_t> gNumMisses{0u};
+
+    // Hash `prefix` followed by the generic form of `op`. The generic form of
+    // an operation printed on its own spells out every type in full, rather
+    // than through aliases defined at the top of the module, so the text
+    // covers the types that the operation uses. Printing in the operation's
+    // own scope keeps the value numbering independent of the rest of the
+    // module.
+    static uint64_t HashPrinted(mlir::Operation *op, std::string text)
+    {
+      llvm::raw_string_ostream os(text);
+      op->print(os, mlir::OpPrintingFlags().printGenericOpForm().useLocalScope());
+      os.flush();
+
+      return llvm::xxh3_64bits(llvm::ArrayRef<uint8_t>(
+          reinterpret_cast<const uint8_t *>(text.data()), text.size()));
+    }
+
+  } // namespace
+
+  uint64_t FunctionCache::NumHits(void)
+  {
+    return gNumHits.load();
+  }
+
+  uint64_t FunctionCache::NumMisses(void)
+  {
+    return gNumMisses.load();
+  }
+
+  FunctionCache::FunctionCache(std::string dir_, std::string salt_)
+      : dir(std::move(dir_)),
+        salt(std::move(salt_))
+  {
+    (void)llvm::sys::fs::create_directories(dir);
+  }
+
+  std::string FunctionCache::PathOf(uint64_t key) const
+  {
+    llvm::SmallString<256> path(dir);
+    llvm::sys::path::append(path, llvm::format_hex_no_prefix(key, 16).str() +
+                                      ".c");
+    return std::string(path.str());
+  }
+
+  uint64_t FunctionCache::Key(mlir::Operation *func) const
+  {
+    std::string prefix = PILLAR_VERSION;
+    prefix.push_back('\0');
+    prefix += salt;
+    prefix.push_back('\0');
+    return HashPrinted(func, std::move(prefix));
+  }
+
+  uint64_t FunctionCache::Fingerprint(mlir::Operation *op)
+  {
+    return HashPrinted(op, {});
+  }
+
+  std::optional<std::string> FunctionCache::Find(uint64_t key) const
+  {
+    auto maybe_buffer = llvm::MemoryBuffer::getFile(
+        PathOf(key), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!maybe_buffer)
+    {
+      gNumMisses.fetch_add(1u);
+      return std::nullopt;
+    }
+
+    gNumHits.fetch_add(1u);
+    return std::string(maybe_buffer.get()->getBuffer());
+  }
+
+  void FunctionCache::Store(uint64_t key, std::string_view code) const
+  {
+    const std::string path = PathOf(key);
+    int fd = -1;
+    llvm::SmallString<256> tmp_path;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", fd, tmp_path))
+    {
+      return;
+    }
+
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os.write(code.data(), code.size());
+    os.close();
+    if (os.has_error())
+    {
+      os.clear_error();
+      llvm::sys::fs::remove(tmp_path);
+      return;
+    }
+
+    // Any two stores of the same key have the same contents, so it doesn't
+    // matter who wins.
+    if (llvm::sys::fs::rename(tmp_path, path))
+    {
+      llvm::sys::fs::remove(tmp_path);
+    }
+  }
+
+} // namespace pillar
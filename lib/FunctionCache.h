@@ -0,0 +1,59 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace mlir
+{
+  class Operation;
+} // namespace mlir
+namespace pillar
+{
+
+  // An on-disk cache of the C code lifted for individual functions. Each entry
+  // is a file in the cache directory, named after the key of the function it
+  // holds.
+  class FunctionCache
+  {
+  private:
+    const std::string dir;
+
+    // Everything besides the function itself that affects the lifted code.
+    const std::string salt;
+
+    std::string PathOf(uint64_t key) const;
+
+  public:
+    FunctionCache(std::string dir, std::string salt);
+
+    // A stable hash of `func`, including its body, its signature, and every
+    // type that it uses, along with the salt and pillar's version.
+    uint64_t Key(mlir::Operation *func) const;
+
+    // Returns the cached C code for the function with `key`, if any. Counts a
+    // hit or miss.
+    std::optional<std::string> Find(uint64_t key) const;
+
+    // Save `code` as the C code for the function with `key`. Concurrent stores
+    // of the same key are safe, as is losing a race with another process.
+    void Store(uint64_t key, std::string_view code) const;
+
+    // A hash of `op` alone, e.g. for telling whether two revisions of a
+    // function differ. Unlike `Key`, this doesn't depend on pillar's version
+    // or on how `op` is lifted.
+    static uint64_t Fingerprint(mlir::Operation *op);
+
+    // Totals of the lookups made by every cache in this process.
+    static uint64_t NumHits(void);
+    static uint64_t NumMisses(void);
+  };
+
+} // namespace pillar
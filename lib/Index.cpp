@@ -0,0 +1,172 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "Index.h"
+
+#include <algorithm>
+#include <optional>
+#include <string>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/Decl.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+#pragma GCC diagnostic pop
+
+namespace pillar
+{
+  namespace
+  {
+
+    template <typename T>
+    static T ToLittle(T val)
+    {
+      return llvm::support::endian::byte_swap<T, llvm::support::little>(val);
+    }
+
+    static std::optional<IndexKind> KindOf(const clang::Decl *decl)
+    {
+      if (clang::isa<clang::FunctionDecl>(decl))
+      {
+        return IndexKind::kFunction;
+      }
+      else if (clang::isa<clang::VarDecl>(decl))
+      {
+        return IndexKind::kGlobal;
+      }
+      else if (clang::isa<clang::RecordDecl>(decl))
+      {
+        return IndexKind::kRecord;
+      }
+      return std::nullopt;
+    }
+
+  } // namespace
+
+  bool WriteIndex(llvm::StringRef path,
+                  const std::vector<PrintedDecl> &printed)
+  {
+    // Keep one entry per kind and name, preferring definitions, and otherwise
+    // the last declaration. Tags and ordinary identifiers are separate
+    // namespaces in C, so the map is keyed on the kind followed by the name.
+    struct Named
+    {
+      const PrintedDecl *decl;
+      IndexKind kind;
+      llvm::StringRef name;
+      uint64_t hash;
+    };
+    llvm::StringMap<Named> by_name;
+    std::string key;
+    for (const PrintedDecl &pd : printed)
+    {
+      auto nd = clang::dyn_cast<clang::NamedDecl>(pd.decl);
+      std::optional<IndexKind> kind = KindOf(pd.decl);
+      if (!nd || !kind || !nd->getIdentifier() || nd->getName().empty())
+      {
+        continue;
+      }
+
+      key.assign(1u, static_cast<char>(kind.value()));
+      key += nd->getName();
+      auto [it, added] = by_name.try_emplace(key);
+      Named &named = it->second;
+      if (added || pd.is_definition || !named.decl->is_definition)
+      {
+        named.decl = &pd;
+        named.kind = kind.value();
+        named.name = it->first().drop_front();
+      }
+    }
+
+    std::vector<std::pair<llvm::StringRef, Named>> named;
+    named.reserve(by_name.size());
+    for (auto &entry : by_name)
+    {
+      Named &info = entry.second;
+      info.hash = IndexHash(
+          info.kind, std::string_view(info.name.data(), info.name.size()));
+      named.emplace_back(info.name, info);
+    }
+
+    const uint64_t num_buckets = std::max<uint64_t>(1u, named.size());
+    std::stable_sort(named.begin(), named.end(),
+                     [=](const auto &a, const auto &b)
+                     {
+                       return (a.second.hash % num_buckets) <
+                              (b.second.hash % num_buckets);
+                     });
+
+    std::vector<uint64_t> buckets(num_buckets + 1u, 0u);
+    for (const auto &[name, info] : named)
+    {
+      buckets[(info.hash % num_buckets) + 1u]++;
+    }
+    for (uint64_t i = 1u; i <= num_buckets; ++i)
+    {
+      buckets[i] += buckets[i - 1u];
+    }
+
+    std::vector<IndexEntry> entries;
+    entries.reserve(named.size());
+    std::string names;
+    for (const auto &[name, info] : named)
+    {
+      IndexEntry entry = {};
+      entry.name_hash = ToLittle(info.hash);
+      entry.name_offset = ToLittle<uint64_t>(names.size());
+      entry.name_length = ToLittle<uint32_t>(static_cast<uint32_t>(name.size()));
+      entry.kind = static_cast<IndexKind>(
+          ToLittle(static_cast<uint32_t>(info.kind)));
+      entry.offset = ToLittle(info.decl->offset);
+      entry.length = ToLittle(info.decl->length);
+      entries.push_back(entry);
+      names.append(name.data(), name.size());
+    }
+
+    for (uint64_t &bucket : buckets)
+    {
+      bucket = ToLittle(bucket);
+    }
+
+    IndexHeader header = {};
+    std::copy(std::begin(kIndexMagic), std::end(kIndexMagic), header.magic);
+    header.version = ToLittle(kIndexVersion);
+    header.num_buckets = ToLittle(static_cast<uint32_t>(num_buckets));
+    header.num_entries = ToLittle<uint64_t>(entries.size());
+    header.names_offset = ToLittle<uint64_t>(
+        sizeof(IndexHeader) + buckets.size() * sizeof(uint64_t) +
+        entries.size() * sizeof(IndexEntry));
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::OF_None);
+    if (ec)
+    {
+      return false;
+    }
+    os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    os.write(reinterpret_cast<const char *>(buckets.data()),
+             buckets.size() * sizeof(uint64_t));
+    os.write(reinterpret_cast<const char *>(entries.data()),
+             entries.size() * sizeof(IndexEntry));
+    os << names;
+    os.close();
+    if (os.has_error())
+    {
+      os.clear_error();
+      return false;
+    }
+    return true;
+  }
+
+} // namespace pillar
@@ -0,0 +1,26 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include <pillar/Index.h>
+#include <vector>
+
+#include "Printer.h"
+
+namespace llvm
+{
+  class StringRef;
+} // namespace llvm
+namespace pillar
+{
+
+  // Write the index of the named functions, global variables, and records in
+  // `printed` to `path`. Returns `false` if the file couldn't be written.
+  bool WriteIndex(llvm::StringRef path,
+                  const std::vector<PrintedDecl> &printed);
+
+} // namespace pillar
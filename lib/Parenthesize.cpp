@@ -0,0 +1,326 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "Clang.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/Expr.h>
+#include <clang/AST/Stmt.h>
+#include <llvm/ADT/DenseSet.h>
+#pragma GCC diagnostic pop
+
+namespace pillar
+{
+  namespace
+  {
+
+    // C operator precedence, from loosest to tightest binding.
+    enum class Precedence : uint8_t
+    {
+      kComma,
+      kAssignment,
+      kConditional,
+      kLogicalOr,
+      kLogicalAnd,
+      kBitwiseOr,
+      kBitwiseXor,
+      kBitwiseAnd,
+      kEquality,
+      kRelational,
+      kShift,
+      kAdditive,
+      kMultiplicative,
+      kPointerToMember, // C++ only.
+      kPrefix,
+      kPostfix,
+      kPrimary,
+    };
+
+    static constexpr Precedence BinaryPrecedence(clang::BinaryOperatorKind opc)
+    {
+      switch (opc)
+      {
+      case clang::BO_PtrMemD:
+      case clang::BO_PtrMemI:
+        return Precedence::kPointerToMember;
+      case clang::BO_Mul:
+      case clang::BO_Div:
+      case clang::BO_Rem:
+        return Precedence::kMultiplicative;
+      case clang::BO_Add:
+      case clang::BO_Sub:
+        return Precedence::kAdditive;
+      case clang::BO_Shl:
+      case clang::BO_Shr:
+        return Precedence::kShift;
+      case clang::BO_Cmp: // C++ only.
+      case clang::BO_LT:
+      case clang::BO_GT:
+      case clang::BO_LE:
+      case clang::BO_GE:
+        return Precedence::kRelational;
+      case clang::BO_EQ:
+      case clang::BO_NE:
+        return Precedence::kEquality;
+      case clang::BO_And:
+        return Precedence::kBitwiseAnd;
+      case clang::BO_Xor:
+        return Precedence::kBitwiseXor;
+      case clang::BO_Or:
+        return Precedence::kBitwiseOr;
+      case clang::BO_LAnd:
+        return Precedence::kLogicalAnd;
+      case clang::BO_LOr:
+        return Precedence::kLogicalOr;
+      case clang::BO_Assign:
+      case clang::BO_MulAssign:
+      case clang::BO_DivAssign:
+      case clang::BO_RemAssign:
+      case clang::BO_AddAssign:
+      case clang::BO_SubAssign:
+      case clang::BO_ShlAssign:
+      case clang::BO_ShrAssign:
+      case clang::BO_AndAssign:
+      case clang::BO_XorAssign:
+      case clang::BO_OrAssign:
+        return Precedence::kAssignment;
+      case clang::BO_Comma:
+        return Precedence::kComma;
+      }
+      return Precedence::kPrimary;
+    }
+
+    static constexpr std::array<Precedence, clang::BO_Comma + 1u>
+    MakeBinaryPrecedenceTable(void)
+    {
+      std::array<Precedence, clang::BO_Comma + 1u> table = {};
+      for (unsigned opc = 0u; opc < table.size(); ++opc)
+      {
+        table[opc] =
+            BinaryPrecedence(static_cast<clang::BinaryOperatorKind>(opc));
+      }
+      return table;
+    }
+
+    static constexpr std::array<Precedence, clang::BO_Comma + 1u>
+        kBinaryPrecedence = MakeBinaryPrecedenceTable();
+
+    static_assert(kBinaryPrecedence[clang::BO_Mul] >
+                  kBinaryPrecedence[clang::BO_Add]);
+    static_assert(kBinaryPrecedence[clang::BO_Shl] >
+                  kBinaryPrecedence[clang::BO_LT]);
+    static_assert(kBinaryPrecedence[clang::BO_EQ] >
+                  kBinaryPrecedence[clang::BO_And]);
+    static_assert(kBinaryPrecedence[clang::BO_And] >
+                  kBinaryPrecedence[clang::BO_Xor]);
+    static_assert(kBinaryPrecedence[clang::BO_Xor] >
+                  kBinaryPrecedence[clang::BO_Or]);
+    static_assert(kBinaryPrecedence[clang::BO_LAnd] >
+                  kBinaryPrecedence[clang::BO_LOr]);
+
+    // Assignments and conditionals group right-to-left, as do the prefix
+    // operators, which can only ever have an operand on their right.
+    static constexpr bool IsRightAssociative(Precedence prec)
+    {
+      return prec == Precedence::kAssignment ||
+             prec == Precedence::kConditional || prec == Precedence::kPrefix;
+    }
+
+    // Implicit casts aren't printed, so they take on the precedence of the
+    // expression that they cast.
+    static Precedence PrecedenceOf(const clang::Stmt *stmt)
+    {
+      while (auto cast = clang::dyn_cast<clang::ImplicitCastExpr>(stmt))
+      {
+        stmt = cast->getSubExpr();
+      }
+
+      if (auto bo = clang::dyn_cast<clang::BinaryOperator>(stmt))
+      {
+        return kBinaryPrecedence[bo->getOpcode()];
+      }
+
+      if (auto uo = clang::dyn_cast<clang::UnaryOperator>(stmt))
+      {
+        return uo->isPostfix() ? Precedence::kPostfix : Precedence::kPrefix;
+      }
+
+      if (clang::isa<clang::CStyleCastExpr>(stmt) ||
+          clang::isa<clang::UnaryExprOrTypeTraitExpr>(stmt))
+      {
+        return Precedence::kPrefix;
+      }
+
+      if (clang::isa<clang::CallExpr>(stmt) ||
+          clang::isa<clang::ArraySubscriptExpr>(stmt) ||
+          clang::isa<clang::MemberExpr>(stmt) ||
+          clang::isa<clang::CompoundLiteralExpr>(stmt))
+      {
+        return Precedence::kPostfix;
+      }
+
+      if (clang::isa<clang::AbstractConditionalOperator>(stmt))
+      {
+        return Precedence::kConditional;
+      }
+
+      return Precedence::kPrimary;
+    }
+
+    // Returns `true` if an operand with precedence `prec` must be wrapped in
+    // parentheses to be the `index`th child of `parent`.
+    static bool NeedsParens(const clang::Stmt *parent, unsigned index,
+                            Precedence prec)
+    {
+      // Binary operators, left then right.
+      if (auto bo = clang::dyn_cast<clang::BinaryOperator>(parent))
+      {
+        const Precedence op_prec = kBinaryPrecedence[bo->getOpcode()];
+        if (prec != op_prec)
+        {
+          return prec < op_prec;
+        }
+        return IsRightAssociative(op_prec) ? index == 0u : index == 1u;
+      }
+
+      // Unary operators and casts, which bind tighter than anything except the
+      // postfix operators.
+      if (auto uo = clang::dyn_cast<clang::UnaryOperator>(parent))
+      {
+        return prec < (uo->isPostfix() ? Precedence::kPostfix
+                                       : Precedence::kPrefix);
+      }
+
+      if (clang::isa<clang::CStyleCastExpr>(parent))
+      {
+        return prec < Precedence::kPrefix;
+      }
+
+      // Condition, then true, then false. Anything goes between `?` and `:`.
+      if (clang::isa<clang::ConditionalOperator>(parent))
+      {
+        switch (index)
+        {
+        case 0u:
+          return prec <= Precedence::kConditional;
+        case 1u:
+          return false;
+        default:
+          return prec < Precedence::kConditional;
+        }
+      }
+
+      // The base of a postfix expression must be postfix or primary. Array
+      // subscripts are `base[index]` unless written `index[base]`.
+      if (auto ase = clang::dyn_cast<clang::ArraySubscriptExpr>(parent))
+      {
+        const unsigned base_index = ase->getLHS() == ase->getBase() ? 0u : 1u;
+        return index == base_index && prec < Precedence::kPostfix;
+      }
+
+      if (clang::isa<clang::MemberExpr>(parent))
+      {
+        return prec < Precedence::kPostfix;
+      }
+
+      // Callee, then arguments. A comma operator in an argument list would be
+      // taken as separating two arguments.
+      if (clang::isa<clang::CallExpr>(parent))
+      {
+        return index == 0u ? prec < Precedence::kPostfix
+                           : prec == Precedence::kComma;
+      }
+
+      // Likewise for initializer lists, and for the initializers of variables
+      // declared in a `DeclStmt`.
+      if (clang::isa<clang::InitListExpr>(parent) ||
+          clang::isa<clang::DeclStmt>(parent))
+      {
+        return prec == Precedence::kComma;
+      }
+
+      return false;
+    }
+
+  } // namespace
+
+  void ClangModuleImpl::Parenthesize(clang::Stmt *root)
+  {
+    if (!root)
+    {
+      return;
+    }
+
+    // Whether or not a child needs parentheses depends only on the child and
+    // on its parent, so the order in which parents are visited doesn't matter.
+    // The lifted AST can share sub-trees, so each node is only visited once;
+    // wrapping a child in a `ParenExpr` gives it primary precedence, so
+    // visiting it again would be a no-op anyway.
+    llvm::DenseSet<clang::Stmt *> seen;
+    std::vector<clang::Stmt *> work_list;
+    work_list.push_back(root);
+    seen.insert(root);
+
+    while (!work_list.empty())
+    {
+      clang::Stmt *parent = work_list.back();
+      work_list.pop_back();
+
+      unsigned index = 0u;
+      for (clang::Stmt *&child : parent->children())
+      {
+        const unsigned child_index = index++;
+        if (!child)
+        {
+          continue;
+        }
+
+        clang::Stmt *original_child = child;
+        if (seen.insert(original_child).second)
+        {
+          work_list.push_back(original_child);
+        }
+
+        if (auto child_expr = clang::dyn_cast<clang::Expr>(child);
+            child_expr &&
+            NeedsParens(parent, child_index, PrecedenceOf(child_expr)))
+        {
+          child = CreateParen(child_expr);
+        }
+      }
+    }
+  }
+
+  void ClangModuleImpl::Parenthesize(clang::Decl *decl)
+  {
+    if (auto func = clang::dyn_cast<clang::FunctionDecl>(decl))
+    {
+      Parenthesize(func->getBody());
+    }
+    else if (auto var = clang::dyn_cast<clang::VarDecl>(decl))
+    {
+      if (clang::Expr *init = var->getInit())
+      {
+        Parenthesize(init);
+        if (PrecedenceOf(init) == Precedence::kComma)
+        {
+          var->setInit(CreateParen(init));
+        }
+      }
+    }
+  }
+
+} // namespace pillar
@@ -0,0 +1,326 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#include "Printer.h"
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/Attr.h>
+#include <clang/AST/Decl.h>
+#include <clang/AST/PrettyPrinter.h>
+#include <clang/AST/Type.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#pragma GCC diagnostic pop
+
+namespace pillar
+{
+  namespace
+  {
+
+    // Each thread gets several batches of declarations, so that a thread that
+    // drew a few big functions doesn't hold everyone else up.
+    static constexpr unsigned kBatchesPerThread = 4u;
+
+    // What `DeclPrinter` prints for one or more top-level declarations: either
+    // a single declaration, or a tag declaration grouped with the declarations
+    // that use it (e.g. `struct { int x; } a, b;`).
+    struct Chunk
+    {
+      size_t begin;
+      unsigned size;
+      const char *terminator;
+
+      // Already-printed code to use in place of the declaration.
+      const std::string *code;
+    };
+
+    // Mirrors `GetBaseType` in Clang's `DeclPrinter`. Returns `false` on
+    // declarators that C doesn't have.
+    static bool GetBaseType(clang::QualType type, clang::QualType &base_type)
+    {
+      while (!type->isSpecifierType())
+      {
+        if (auto pty = type->getAs<clang::PointerType>())
+        {
+          type = pty->getPointeeType();
+        }
+        else if (auto aty = clang::dyn_cast<clang::ArrayType>(type))
+        {
+          type = aty->getElementType();
+        }
+        else if (auto fty = type->getAs<clang::FunctionType>())
+        {
+          type = fty->getReturnType();
+        }
+        else if (auto vty = type->getAs<clang::VectorType>())
+        {
+          type = vty->getElementType();
+        }
+        else
+        {
+          return false;
+        }
+      }
+      base_type = type;
+      return true;
+    }
+
+    // Mirrors `getDeclType` in Clang's `DeclPrinter`.
+    static clang::QualType GetDeclType(const clang::Decl *decl)
+    {
+      if (auto tdd = clang::dyn_cast<clang::TypedefNameDecl>(decl))
+      {
+        return tdd->getUnderlyingType();
+      }
+      else if (auto vd = clang::dyn_cast<clang::ValueDecl>(decl))
+      {
+        return vd->getType();
+      }
+      return {};
+    }
+
+    // Work out how `DeclPrinter` would lay out the top-level declarations of
+    // `tu` into `decls` and `chunks`. Returns `false` if it would do anything
+    // that this doesn't reproduce.
+    static bool Layout(const clang::TranslationUnitDecl *tu,
+                       const PrintedDefinitions &definitions,
+                       std::vector<clang::Decl *> &decls,
+                       std::vector<Chunk> &chunks)
+    {
+      // A tag that isn't free-standing is held back, and grouped with the
+      // declarations that follow it and name it as their base type.
+      std::optional<Chunk> group;
+
+      for (clang::Decl *decl : tu->decls())
+      {
+        if (decl->isImplicit())
+        {
+          continue;
+        }
+
+        if (decl->hasAttr<clang::OMPDeclareTargetDeclAttr>())
+        {
+          return false;
+        }
+
+        if (group)
+        {
+          clang::QualType type = GetDeclType(decl);
+          clang::QualType base_type;
+          if (!type.isNull())
+          {
+            if (!GetBaseType(type, base_type))
+            {
+              return false;
+            }
+            auto ety = clang::dyn_cast<clang::ElaboratedType>(base_type);
+            if (ety && ety->getOwnedTagDecl() == decls[group->begin])
+            {
+              if (clang::isa<clang::FunctionDecl>(decl) &&
+                  definitions.count(clang::cast<clang::FunctionDecl>(decl)))
+              {
+                return false;
+              }
+              decls.push_back(decl);
+              group->size++;
+              continue;
+            }
+          }
+
+          chunks.push_back(group.value());
+          group.reset();
+        }
+
+        const size_t index = decls.size();
+        decls.push_back(decl);
+
+        if (auto tag = clang::dyn_cast<clang::TagDecl>(decl))
+        {
+          if (!tag->isFreeStanding())
+          {
+            group = Chunk{index, 1u, ";\n", nullptr};
+          }
+          else
+          {
+            chunks.push_back({index, 1u, ";\n", nullptr});
+          }
+        }
+        else if (auto func = clang::dyn_cast<clang::FunctionDecl>(decl))
+        {
+          if (func->getTemplatedKind() != clang::FunctionDecl::TK_NonTemplate)
+          {
+            return false;
+          }
+
+          // The statement printer ends a function body with a newline.
+          if (auto it = definitions.find(func); it != definitions.end())
+          {
+            chunks.push_back({index, 1u, "", &(it->second)});
+          }
+          else if (func->doesThisDeclarationHaveABody() &&
+                   !func->isDefaulted())
+          {
+            chunks.push_back({index, 1u, "", nullptr});
+          }
+          else
+          {
+            chunks.push_back({index, 1u, ";\n", nullptr});
+          }
+        }
+        else if (clang::isa<clang::VarDecl>(decl) ||
+                 clang::isa<clang::TypedefNameDecl>(decl))
+        {
+          chunks.push_back({index, 1u, ";\n", nullptr});
+        }
+        else
+        {
+          return false;
+        }
+      }
+
+      if (group)
+      {
+        chunks.push_back(group.value());
+      }
+      return true;
+    }
+
+    static void PrintChunk(llvm::raw_ostream &os,
+                           const clang::PrintingPolicy &policy,
+                           std::vector<clang::Decl *> &decls,
+                           const Chunk &chunk)
+    {
+      if (chunk.code)
+      {
+        os << *(chunk.code);
+      }
+      else
+      {
+        clang::Decl::printGroup(&(decls[chunk.begin]), chunk.size, os, policy,
+                                /*Indentation=*/0u);
+        os << chunk.terminator;
+      }
+    }
+
+  } // namespace
+
+  bool IsDefinition(const clang::Decl *decl)
+  {
+    if (auto func = clang::dyn_cast<clang::FunctionDecl>(decl))
+    {
+      return func->doesThisDeclarationHaveABody();
+    }
+    else if (auto var = clang::dyn_cast<clang::VarDecl>(decl))
+    {
+      return var->isThisDeclarationADefinition() !=
+             clang::VarDecl::DeclarationOnly;
+    }
+    else if (auto tag = clang::dyn_cast<clang::TagDecl>(decl))
+    {
+      return tag->isThisDeclarationADefinition();
+    }
+    return false;
+  }
+
+  bool PrintInParallel(llvm::raw_ostream &os,
+                       const clang::TranslationUnitDecl *tu,
+                       unsigned num_threads,
+                       const PrintedDefinitions &definitions,
+                       std::vector<PrintedDecl> *printed)
+  {
+    std::vector<clang::Decl *> decls;
+    std::vector<Chunk> chunks;
+    if (!Layout(tu, definitions, decls, chunks))
+    {
+      if (!definitions.empty())
+      {
+        return false;
+      }
+      tu->print(os);
+      return true;
+    }
+
+    // The number of bytes printed for each chunk.
+    std::vector<uint64_t> lengths(chunks.size());
+
+    const clang::PrintingPolicy policy = tu->getASTContext().getPrintingPolicy();
+    if (num_threads == 1u || chunks.size() < 2u)
+    {
+      for (size_t i = 0u; i < chunks.size(); ++i)
+      {
+        const uint64_t begin = os.tell();
+        PrintChunk(os, policy, decls, chunks[i]);
+        lengths[i] = os.tell() - begin;
+      }
+    }
+    else
+    {
+      llvm::ThreadPoolStrategy strategy =
+          llvm::hardware_concurrency(num_threads);
+      const unsigned num_batches = std::min<unsigned>(
+          static_cast<unsigned>(chunks.size()),
+          strategy.compute_thread_count() * kBatchesPerThread);
+
+      // Printing only reads the AST, so the batches can be rendered
+      // concurrently, each into its own buffer.
+      std::vector<std::string> buffers(num_batches);
+      {
+        llvm::ThreadPool pool(strategy);
+        for (unsigned i = 0u; i < num_batches; ++i)
+        {
+          const size_t begin = chunks.size() * i / num_batches;
+          const size_t end = chunks.size() * (i + 1u) / num_batches;
+          pool.async([&, begin, end, i](void)
+                     {
+                       llvm::raw_string_ostream batch_os(buffers[i]);
+                       for (size_t j = begin; j < end; ++j)
+                       {
+                         const uint64_t chunk_begin = batch_os.tell();
+                         PrintChunk(batch_os, policy, decls, chunks[j]);
+                         lengths[j] = batch_os.tell() - chunk_begin;
+                       } });
+        }
+        pool.wait();
+      }
+
+      for (const std::string &buffer : buffers)
+      {
+        os << buffer;
+      }
+    }
+
+    if (!printed)
+    {
+      return true;
+    }
+
+    uint64_t offset = 0u;
+    for (size_t i = 0u; i < chunks.size(); ++i)
+    {
+      const Chunk &chunk = chunks[i];
+      for (unsigned j = 0u; j < chunk.size; ++j)
+      {
+        const clang::Decl *decl = decls[chunk.begin + j];
+        printed->push_back({decl, chunk.code || IsDefinition(decl), offset,
+                            lengths[i]});
+      }
+      offset += lengths[i];
+    }
+    return true;
+  }
+
+} // namespace pillar
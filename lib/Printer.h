@@ -0,0 +1,75 @@
+// Copyright (c) 2023-present, Trail of Bits, Inc.
+// All rights reserved.
+//
+// This source code is licensed in accordance with the terms specified in
+// the LICENSE file found in the root directory of this source tree.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wbitfield-enum-conversion"
+#pragma GCC diagnostic ignored "-Wimplicit-int-conversion"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#pragma GCC diagnostic ignored "-Wshorten-64-to-32"
+#include <llvm/ADT/DenseMap.h>
+#pragma GCC diagnostic pop
+
+namespace llvm
+{
+  class raw_ostream;
+} // namespace llvm
+namespace clang
+{
+  class Decl;
+  class FunctionDecl;
+  class TranslationUnitDecl;
+} // namespace clang
+namespace pillar
+{
+
+  // Already-printed definitions of functions that are only declared in the
+  // AST, e.g. because they came from the function cache.
+  using PrintedDefinitions =
+      llvm::DenseMap<const clang::FunctionDecl *, std::string>;
+
+  // Where a top-level declaration ended up in printed output.
+  struct PrintedDecl
+  {
+    const clang::Decl *decl;
+
+    // Whether this is the declaration's definition, rather than a prototype
+    // or forward declaration.
+    bool is_definition;
+
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  // Print `tu` as C source code to `os`, producing exactly what
+  // `tu->print(os)` would, except that functions in `definitions` are printed
+  // as their given definitions. Top-level declarations are rendered
+  // concurrently on up to `num_threads` threads (zero meaning one per hardware
+  // thread), and their renderings are written out in declaration order.
+  //
+  // If `printed` isn't null, then where each top-level declaration was
+  // printed is appended to it, with offsets counted from where `os` was when
+  // printing began.
+  //
+  // This knows how to lay out the top-level declarations of C code. Anything
+  // else is printed serially by Clang, leaving `printed` alone. That can't
+  // include `definitions`, so if there are any then nothing is printed and
+  // this returns `false`; lifting only ever produces C.
+  bool PrintInParallel(llvm::raw_ostream &os,
+                       const clang::TranslationUnitDecl *tu,
+                       unsigned num_threads,
+                       const PrintedDefinitions &definitions,
+                       std::vector<PrintedDecl> *printed = nullptr);
+
+  // Whether `decl`, printed on its own, is a definition.
+  bool IsDefinition(const clang::Decl *decl);
+
+} // namespace pillar
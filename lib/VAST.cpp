@@ -7,9 +7,21 @@
 #include "VAST.h"
 
 #include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/bit.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mlir/Bytecode/BytecodeReader.h>
+#include <mlir/Bytecode/BytecodeWriter.h>
+#include <mlir/Dialect/DLTI/DLTI.h>
 #include <mlir/InitAllDialects.h>
+#include <mlir/IR/Diagnostics.h>
 #include <mlir/IR/Operation.h>
 #include <mlir/IR/OperationSupport.h>
 #include <mlir/Parser/Parser.h>
@@ -20,37 +32,353 @@
 #include <vast/Dialect/Meta/MetaTypes.hpp>
 #include <vast/Dialect/Dialects.hpp>
 
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 namespace pillar
 {
   namespace
   {
 
-    static llvm::DenseMap<llvm::StringRef, HlOpKind> gNameToKindMap;
-    static llvm::DenseMap<mlir::TypeID, HlOpKind> gTypeIDToKindMap;
-
-    class RegistryInitializer
+    // Built on first use, rather than during static initialization, so that
+    // processes which link against us but never deserialize anything don't pay
+    // for them.
+    class DialectRegistries
     {
     public:
-      mlir::DialectRegistry registry;
-      std::vector<mlir::TypeID> op_types;
+      // The dialects that HL modules produced by VAST use: VAST's own, plus
+      // DLTI for the module's data layout. The builtin dialect is always
+      // loaded.
+      mlir::DialectRegistry minimal;
+
+      // Every VAST and upstream MLIR dialect.
+      mlir::DialectRegistry full;
 
-      RegistryInitializer(void)
+      DialectRegistries(void)
       {
-        vast::registerAllDialects(registry);
-        mlir::registerAllDialects(registry);
+        vast::registerAllDialects(minimal);
+        minimal.insert<mlir::DLTIDialect>();
+
+        vast::registerAllDialects(full);
+        mlir::registerAllDialects(full);
+      }
+    };
+
+    static const DialectRegistries &GetDialectRegistries(void)
+    {
+      static const DialectRegistries registries;
+      return registries;
+    }
+
+    class OpKindMaps
+    {
+    public:
+      llvm::DenseMap<llvm::StringRef, HlOpKind> name_to_kind;
+      llvm::DenseMap<mlir::TypeID, HlOpKind> type_id_to_kind;
 
-#define ADD_OP_TO_MAPS(o)                                        \
-  gNameToKindMap.try_emplace(vast::hl::o::getOperationName(),    \
-                             HlOpKind::k##o);                    \
-  gTypeIDToKindMap.try_emplace(mlir::TypeID::get<vast::hl::o>(), \
-                               HlOpKind::k##o);
+      OpKindMaps(void)
+      {
+#define ADD_OP_TO_MAPS(o)                                         \
+  name_to_kind.try_emplace(vast::hl::o::getOperationName(),       \
+                           HlOpKind::k##o);                       \
+  type_id_to_kind.try_emplace(mlir::TypeID::get<vast::hl::o>(),   \
+                              HlOpKind::k##o);
 
         HL_DIALECT_OPS(ADD_OP_TO_MAPS)
 #undef ADD_OP_TO_MAPS
       }
     };
 
-    static RegistryInitializer gMLIR;
+    static const OpKindMaps &GetOpKindMaps(void)
+    {
+      static const OpKindMaps maps;
+      return maps;
+    }
+
+    // Pool of MLIR contexts that have already been used to deserialize a module.
+    // Contexts keep every type and attribute that they have ever uniqued, so a
+    // context is retired after `kMaxContextUses` modules to bound its growth.
+    class ContextPool
+    {
+    private:
+      static constexpr unsigned kMaxContextUses = 64u;
+
+      // Shared by all pooled contexts, rather than each context spinning up its
+      // own threads. Declared first so that it outlives the contexts.
+      llvm::ThreadPool thread_pool;
+
+      struct ContextInfo
+      {
+        unsigned num_uses{0u};
+        bool full_registry{false};
+      };
+
+      std::mutex lock;
+      std::vector<std::unique_ptr<mlir::MLIRContext>> free_contexts;
+      llvm::DenseMap<mlir::MLIRContext *, ContextInfo> infos;
+      const unsigned max_free_contexts;
+
+      // Register every dialect with `context`. Appending a registry twice would
+      // duplicate its dialect extensions, hence the tracking.
+      static void UpgradeRegistry(mlir::MLIRContext &context, ContextInfo &info)
+      {
+        if (!info.full_registry)
+        {
+          context.appendDialectRegistry(GetDialectRegistries().full);
+          info.full_registry = true;
+        }
+      }
+
+    public:
+      ContextPool(void)
+          : max_free_contexts(std::max(1u, std::thread::hardware_concurrency())) {}
+
+      mlir::MLIRContext *Acquire(bool full_registry)
+      {
+        const DialectRegistries &registries = GetDialectRegistries();
+        {
+          std::lock_guard<std::mutex> locker(lock);
+          if (!free_contexts.empty())
+          {
+            mlir::MLIRContext *context = free_contexts.back().release();
+            free_contexts.pop_back();
+            if (full_registry)
+            {
+              UpgradeRegistry(*context, infos[context]);
+            }
+            return context;
+          }
+        }
+
+        auto context = std::make_unique<mlir::MLIRContext>(
+            full_registry ? registries.full : registries.minimal,
+            mlir::MLIRContext::Threading::DISABLED);
+        context->setThreadPool(thread_pool);
+
+        std::lock_guard<std::mutex> locker(lock);
+        infos[context.get()].full_registry = full_registry;
+        return context.release();
+      }
+
+      bool HasFullRegistry(mlir::MLIRContext *context)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        return infos[context].full_registry;
+      }
+
+      void UpgradeRegistry(mlir::MLIRContext *context)
+      {
+        std::lock_guard<std::mutex> locker(lock);
+        UpgradeRegistry(*context, infos[context]);
+      }
+
+      void Release(mlir::MLIRContext *context_)
+      {
+        std::unique_ptr<mlir::MLIRContext> context(context_);
+        std::lock_guard<std::mutex> locker(lock);
+        ContextInfo &info = infos[context_];
+        if (++info.num_uses < kMaxContextUses &&
+            free_contexts.size() < max_free_contexts)
+        {
+          free_contexts.emplace_back(std::move(context));
+        }
+        else
+        {
+          infos.erase(context_);
+        }
+      }
+    };
+
+    static ContextPool gContextPool;
+
+    static constexpr llvm::StringLiteral kBytecodeSidecarExtension = ".mlirbc";
+    static constexpr llvm::StringLiteral kBytecodeProducer = "pillar";
+
+    // Only function bodies are worth deferring; everything else at the top
+    // level of an HL module is needed to lift declarations anyway.
+    static bool IsLazyLoadable(mlir::Operation *op)
+    {
+      return mlir::isa<vast::hl::FuncOp>(op);
+    }
+
+    // Read the top level of the bytecode module in `sm`, leaving the regions of
+    // lazy-loadable operations to be materialized on demand.
+    static bool ReadLazily(VASTModuleImpl &impl,
+                           std::shared_ptr<llvm::SourceMgr> sm)
+    {
+      const llvm::MemoryBuffer *buffer = sm->getMemoryBuffer(sm->getMainFileID());
+      mlir::ParserConfig config(&(impl.context), /*verifyAfterParse=*/false);
+      auto reader = std::make_unique<mlir::BytecodeReader>(
+          buffer->getMemBufferRef(), config, /*lazyLoad=*/true, sm);
+
+      mlir::Block block;
+      if (mlir::failed(reader->readTopLevel(&block, IsLazyLoadable)) ||
+          !llvm::hasSingleElement(block))
+      {
+        return false;
+      }
+
+      auto module_op = mlir::dyn_cast<mlir::ModuleOp>(block.front());
+      if (!module_op)
+      {
+        return false;
+      }
+
+      module_op->remove();
+      impl.module = mlir::OwningOpRef<mlir::ModuleOp>(module_op);
+      impl.reader = std::move(reader);
+      impl.source = std::move(sm);
+      return true;
+    }
+
+    static bool Parse(VASTModuleImpl &impl,
+                      const std::shared_ptr<llvm::SourceMgr> &sm,
+                      bool bytecode, bool lazy)
+    {
+      if (lazy)
+      {
+        return ReadLazily(impl, sm);
+      }
+
+      impl.module = mlir::parseSourceFile<mlir::ModuleOp>(sm, &(impl.context));
+      if (!impl.module)
+      {
+        return false;
+      }
+
+      if (bytecode)
+      {
+        impl.source = sm;
+      }
+
+      return true;
+    }
+
+    // Parse `buffer` into a new module. The buffer is owned by the source
+    // manager for the duration of the parse, so mapped files are read in place.
+    // The parser dispatches on the bytecode magic number, so this handles both
+    // textual MLIR and MLIR bytecode.
+    static std::optional<std::shared_ptr<VASTModuleImpl>> ParseBuffer(
+        std::unique_ptr<llvm::MemoryBuffer> buffer,
+        const DeserializeOptions &options)
+    {
+      const bool bytecode = mlir::isBytecode(buffer->getMemBufferRef());
+
+      // Lazily loaded function bodies are read after parsing has finished, so
+      // there's no parse to retry if they turn out to need more dialects.
+      const bool lazy = bytecode && options.lazy_function_bodies;
+      std::shared_ptr<VASTModuleImpl> impl = std::make_shared<VASTModuleImpl>(
+          options.full_dialect_registry || lazy);
+      auto sm = std::make_shared<llvm::SourceMgr>();
+      sm->AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
+
+      // A module that uses dialects outside of the minimal registry fails to
+      // parse. Parse quietly at first, and if that fails, then register every
+      // dialect and parse again, this time reporting any errors.
+      if (!gContextPool.HasFullRegistry(&(impl->context)))
+      {
+        {
+          mlir::ScopedDiagnosticHandler quiet(
+              &(impl->context),
+              [](mlir::Diagnostic &) { return mlir::success(); });
+          if (Parse(*impl, sm, bytecode, lazy))
+          {
+            return impl;
+          }
+        }
+        gContextPool.UpgradeRegistry(&(impl->context));
+      }
+
+      if (!Parse(*impl, sm, bytecode, lazy))
+      {
+        return std::nullopt;
+      }
+
+      return impl;
+    }
+
+    // The producer string recorded in a sidecar identifies the exact text it
+    // was made from: its size and a hash of its contents. Timestamps aren't
+    // enough, as `cp -p`, `rsync -t`, archive extraction, and checkouts all
+    // produce text that is older than a sidecar it doesn't match.
+    static std::string SidecarProducer(llvm::MemoryBufferRef source)
+    {
+      llvm::ArrayRef<uint8_t> bytes(
+          reinterpret_cast<const uint8_t *>(source.getBufferStart()),
+          source.getBufferSize());
+      std::string producer;
+      llvm::raw_string_ostream os(producer);
+      os << kBytecodeProducer << ':';
+      os.write_hex(bytes.size());
+      os << ':';
+      os.write_hex(llvm::xxh3_64bits(bytes));
+      return os.str();
+    }
+
+    // Returns the producer string from the header of the bytecode in `buffer`,
+    // which follows the magic number and the version, a prefix varint.
+    static std::optional<llvm::StringRef> BytecodeProducer(
+        llvm::MemoryBufferRef buffer)
+    {
+      llvm::StringRef data = buffer.getBuffer();
+      if (!mlir::isBytecode(buffer) || data.size() < 5u)
+      {
+        return std::nullopt;
+      }
+
+      const uint8_t lead = static_cast<uint8_t>(data[4]);
+      const size_t version_size =
+          lead ? static_cast<size_t>(llvm::countr_zero(lead)) + 1u : 9u;
+      data = data.drop_front(4u);
+      if (data.size() < version_size)
+      {
+        return std::nullopt;
+      }
+
+      data = data.drop_front(version_size);
+      const size_t end = data.find('\0');
+      if (end == llvm::StringRef::npos)
+      {
+        return std::nullopt;
+      }
+
+      return data.take_front(end);
+    }
+
+    // Write `module` as bytecode to `path`. The bytecode is written to a
+    // temporary file first and then renamed into place, so that concurrent
+    // readers never observe a partially written file.
+    static bool WriteBytecode(mlir::ModuleOp module, llvm::StringRef path,
+                              llvm::StringRef producer = kBytecodeProducer)
+    {
+      int fd = -1;
+      llvm::SmallString<256> tmp_path;
+      if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", fd, tmp_path))
+      {
+        return false;
+      }
+
+      llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+      mlir::BytecodeWriterConfig config(producer);
+      bool ok = mlir::succeeded(mlir::writeBytecodeToFile(module, os, config));
+      os.close();
+      if (os.has_error())
+      {
+        os.clear_error();
+        ok = false;
+      }
+
+      if (!ok || llvm::sys::fs::rename(tmp_path, path))
+      {
+        llvm::sys::fs::remove(tmp_path);
+        return false;
+      }
+
+      return true;
+    }
 
   } // namespace
 
@@ -72,8 +400,9 @@ namespace pillar
     if (auto info = op_name.getRegisteredInfo())
     {
       mlir::TypeID type_id = info->getTypeID();
-      if (auto it = gTypeIDToKindMap.find(type_id);
-          it != gTypeIDToKindMap.end())
+      const OpKindMaps &maps = GetOpKindMaps();
+      if (auto it = maps.type_id_to_kind.find(type_id);
+          it != maps.type_id_to_kind.end())
       {
         return it->second;
       }
@@ -88,8 +417,9 @@ namespace pillar
       return HlOpKind::kUnknown;
     }
 
-    if (auto it = gNameToKindMap.find(op_name.getStringRef());
-        it != gNameToKindMap.end())
+    const OpKindMaps &maps = GetOpKindMaps();
+    if (auto it = maps.name_to_kind.find(op_name.getStringRef());
+        it != maps.name_to_kind.end())
     {
       return it->second;
     }
@@ -97,26 +427,137 @@ namespace pillar
     return HlOpKind::kUnknown;
   }
 
-  VASTModuleImpl::VASTModuleImpl(void)
-      : context(gMLIR.registry) {}
+  void VASTModuleImpl::ContextReleaser::operator()(
+      mlir::MLIRContext *context) const
+  {
+    gContextPool.Release(context);
+  }
+
+  VASTModuleImpl::VASTModuleImpl(bool full_registry)
+      : context_owner(gContextPool.Acquire(full_registry)),
+        context(*context_owner) {}
 
   VASTModuleImpl::~VASTModuleImpl(void) {}
 
+  bool VASTModuleImpl::IsMaterializable(mlir::Operation *op)
+  {
+    if (!reader)
+    {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> locker(reader_lock);
+    return reader->isMaterializable(op);
+  }
+
+  bool VASTModuleImpl::Materialize(mlir::Operation *op)
+  {
+    if (!reader)
+    {
+      return true;
+    }
+
+    std::lock_guard<std::mutex> locker(reader_lock);
+    if (!reader->isMaterializable(op))
+    {
+      return true;
+    }
+
+    return mlir::succeeded(reader->materialize(op));
+  }
+
   VASTModule::~VASTModule(void) {}
 
-  std::optional<VASTModule> VASTModule::Deserialize(std::string_view data)
+  std::optional<VASTModule> VASTModule::Deserialize(
+      std::string_view data, const DeserializeOptions &options)
+  {
+    // The bytecode reader may reference resources in place, and the source
+    // manager holding the buffer outlives this call, so bytecode is copied.
+    // Text is only read while parsing, and so it can alias `data`.
+    llvm::StringRef data_ref(data.data(), data.size());
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    if (mlir::isBytecode(llvm::MemoryBufferRef(data_ref, "")))
+    {
+      buffer = llvm::MemoryBuffer::getMemBufferCopy(data_ref);
+    }
+    else
+    {
+      buffer = llvm::MemoryBuffer::getMemBuffer(data_ref);
+    }
+
+    auto impl = ParseBuffer(std::move(buffer), options);
+    if (!impl)
+    {
+      return std::nullopt;
+    }
+
+    return VASTModule(std::move(impl.value()));
+  }
+
+  std::optional<VASTModule> VASTModule::DeserializeFile(
+      std::string_view path, const DeserializeOptions &options)
   {
-    std::shared_ptr<VASTModuleImpl> impl = std::make_shared<VASTModuleImpl>();
-    llvm::SourceMgr sm;
-    auto buffer = llvm::MemoryBuffer::getMemBuffer(data);
-    sm.AddNewSourceBuffer(std::move(buffer), llvm::SMLoc());
-    impl->module = mlir::parseSourceFile<mlir::ModuleOp>(sm, &(impl->context));
-    if (!impl->module)
+    llvm::StringRef path_ref(path.data(), path.size());
+    const bool use_sidecar = options.bytecode_cache && path_ref != "-";
+    llvm::SmallString<256> sidecar_path(path_ref);
+    sidecar_path += kBytecodeSidecarExtension;
+
+    // `getFileOrSTDIN` memory maps regular files that are large enough to make
+    // it worthwhile, and otherwise reads the whole input into one allocation.
+    // The MLIR lexer relies on the trailing NUL, which the mapping provides
+    // for free unless the file size is an exact multiple of the page size.
+    auto maybe_buffer = llvm::MemoryBuffer::getFileOrSTDIN(path_ref);
+    if (!maybe_buffer)
     {
       return std::nullopt;
     }
 
-    return VASTModule(std::move(impl));
+    // Prefer a sidecar that was made from exactly this text. Hashing the text
+    // is far cheaper than parsing it. If the sidecar turns out to be
+    // unreadable, e.g. because it was produced by an incompatible version of
+    // MLIR, then fall back on the text, which will also refresh the sidecar.
+    const bool text_input =
+        use_sidecar && !mlir::isBytecode(maybe_buffer.get()->getMemBufferRef());
+    std::string producer;
+    if (text_input)
+    {
+      producer = SidecarProducer(maybe_buffer.get()->getMemBufferRef());
+      if (auto maybe_sidecar = llvm::MemoryBuffer::getFile(
+              sidecar_path, /*IsText=*/false,
+              /*RequiresNullTerminator=*/false))
+      {
+        auto sidecar_producer =
+            BytecodeProducer(maybe_sidecar.get()->getMemBufferRef());
+        if (sidecar_producer && *sidecar_producer == producer)
+        {
+          if (auto sidecar_impl =
+                  ParseBuffer(std::move(maybe_sidecar.get()), options))
+          {
+            return VASTModule(std::move(sidecar_impl.value()));
+          }
+        }
+      }
+    }
+
+    auto impl = ParseBuffer(std::move(maybe_buffer.get()), options);
+    if (!impl)
+    {
+      return std::nullopt;
+    }
+
+    // Failing to write the sidecar isn't fatal; we'll just try again next time.
+    if (text_input)
+    {
+      (void)WriteBytecode(impl.value()->module.get(), sidecar_path, producer);
+    }
+
+    return VASTModule(std::move(impl.value()));
+  }
+
+  bool VASTModule::SerializeBytecode(std::string_view path) const
+  {
+    return WriteBytecode(impl->module.get(),
+                         llvm::StringRef(path.data(), path.size()));
   }
 
 } // namespace pillar
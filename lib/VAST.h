@@ -11,6 +11,8 @@
 #include <mlir/IR/MLIRContext.h>
 #include <mlir/IR/OwningOpRef.h>
 
+#include <memory>
+#include <mutex>
 #include <optional>
 
 #define HL_DIALECT_OPS(m)                                                                                                                                                                                                                                                                                                                                                                                                                                                \
@@ -127,8 +129,13 @@
                                                                                                                                                                                                                                                                                                                                                                                                                                                           m(UnionDeclOp) \
                                                                                                                                                                                                                                                                                                                                                                                                                                                               m(UnreachableOp)
 
+namespace llvm
+{
+  class SourceMgr;
+} // namespace llvm
 namespace mlir
 {
+  class BytecodeReader;
   class DialectRegistry;
 } // namespace mlir
 namespace vast
@@ -156,11 +163,44 @@ namespace pillar
   class VASTModuleImpl final
   {
   public:
-    mlir::MLIRContext context;
+    // Hands `context` back to the process-wide context pool.
+    struct ContextReleaser
+    {
+      void operator()(mlir::MLIRContext *context) const;
+    };
+
+    // Contexts are borrowed from a pool so that back-to-back deserializations
+    // reuse loaded dialects, the thread pool, and warm uniquing tables. This is
+    // declared first so that the context is only returned once the module and
+    // everything else that refers into the context has been destroyed.
+    const std::unique_ptr<mlir::MLIRContext, ContextReleaser> context_owner;
+    mlir::MLIRContext &context;
+
+    // Owns the input buffer of modules read from bytecode, which may reference
+    // it directly (e.g. for dense resources). Textual modules are copied into
+    // the context while parsing, so their buffers are released right away.
+    std::shared_ptr<llvm::SourceMgr> source;
+
     mlir::OwningOpRef<mlir::ModuleOp> module;
 
+    // Present when the module was read lazily from bytecode. Declared after
+    // `module` so that it's torn down while the operations it knows about are
+    // still alive.
+    std::unique_ptr<mlir::BytecodeReader> reader;
+    std::mutex reader_lock;
+
     ~VASTModuleImpl(void);
-    VASTModuleImpl(void);
+
+    // If `full_registry` is `true`, then every MLIR dialect is registered with
+    // `context`, and otherwise only those needed by HL modules.
+    explicit VASTModuleImpl(bool full_registry);
+
+    // Returns `true` if `op` has regions that haven't been read yet.
+    bool IsMaterializable(mlir::Operation *op);
+
+    // Read in any lazily loaded regions of `op`. Returns `false` if reading
+    // the regions failed. This is a no-op for eagerly parsed modules.
+    bool Materialize(mlir::Operation *op);
   };
 
 } // namespace pillar